@@ -0,0 +1,190 @@
+// Field aggregation kernels
+
+#include "aggregate.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AGGREGATE_HAVE_AVX2_KERNEL 1
+#endif
+
+namespace {
+
+// Sums are kept in uint64_t, where overflow is defined to wrap, and
+// converted back to the two's complement result
+void addSum(AggregateResult &acc, uint64_t sum) {
+    acc.sum = static_cast<int64_t>(static_cast<uint64_t>(acc.sum) + sum);
+}
+
+template <typename T>
+int64_t loadField(const uint8_t *p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return static_cast<int64_t>(v);
+}
+
+template <typename T>
+void aggregateScalar(const uint8_t *rows, size_t count, size_t stride,
+                     uint32_t offset, AggregateResult &acc) {
+    uint64_t sum = 0;
+    int64_t mn = acc.min;
+    int64_t mx = acc.max;
+    for (size_t i = 0; i < count; ++i) {
+        int64_t w = loadField<T>(rows + i * stride + offset);
+        sum += static_cast<uint64_t>(w);
+        mn = std::min(mn, w);
+        mx = std::max(mx, w);
+    }
+    acc.count += count;
+    addSum(acc, sum);
+    acc.min = mn;
+    acc.max = mx;
+}
+
+#ifdef AGGREGATE_HAVE_AVX2_KERNEL
+
+// Eight rows per step: one gather pulls the field out of eight values,
+// sums are widened to 64 bits, min/max stay in 32-bit lanes.
+template <bool IsUnsigned>
+__attribute__((target("avx2")))
+void aggregate32Avx2(const uint8_t *rows, size_t count, size_t stride,
+                     uint32_t offset, AggregateResult &acc) {
+    const uint8_t *base = rows + offset;
+    const int s = static_cast<int>(stride);
+    const __m256i idx = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+    __m256i sum = _mm256_setzero_si256();
+    __m256i mn = IsUnsigned ? _mm256_set1_epi32(-1) : _mm256_set1_epi32(INT32_MAX);
+    __m256i mx = IsUnsigned ? _mm256_setzero_si256() : _mm256_set1_epi32(INT32_MIN);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_i32gather_epi32(reinterpret_cast<const int *>(base + i * stride), idx, 1);
+        __m128i lo = _mm256_castsi256_si128(v);
+        __m128i hi = _mm256_extracti128_si256(v, 1);
+        if (IsUnsigned) {
+            sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(lo));
+            sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(hi));
+            mn = _mm256_min_epu32(mn, v);
+            mx = _mm256_max_epu32(mx, v);
+        } else {
+            sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(lo));
+            sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(hi));
+            mn = _mm256_min_epi32(mn, v);
+            mx = _mm256_max_epi32(mx, v);
+        }
+    }
+
+    if (i > 0) {
+        alignas(32) uint64_t sums[4];
+        alignas(32) uint32_t mins[8];
+        alignas(32) uint32_t maxs[8];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(sums), sum);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(mins), mn);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(maxs), mx);
+        addSum(acc, sums[0] + sums[1] + sums[2] + sums[3]);
+        acc.count += i;
+        for (int l = 0; l < 8; ++l) {
+            int64_t lmin = IsUnsigned ? static_cast<int64_t>(mins[l])
+                                      : static_cast<int64_t>(static_cast<int32_t>(mins[l]));
+            int64_t lmax = IsUnsigned ? static_cast<int64_t>(maxs[l])
+                                      : static_cast<int64_t>(static_cast<int32_t>(maxs[l]));
+            acc.min = std::min(acc.min, lmin);
+            acc.max = std::max(acc.max, lmax);
+        }
+    }
+    // tail
+    if (IsUnsigned) {
+        aggregateScalar<uint32_t>(rows + i * stride, count - i, stride, offset, acc);
+    } else {
+        aggregateScalar<int32_t>(rows + i * stride, count - i, stride, offset, acc);
+    }
+}
+
+bool cpuHasAvx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+#endif // AGGREGATE_HAVE_AVX2_KERNEL
+
+} // namespace
+
+uint32_t fieldWidth(FieldType type) {
+    switch (type) {
+    case FieldType::INT8:
+    case FieldType::UINT8:
+        return 1;
+    case FieldType::INT16:
+    case FieldType::UINT16:
+        return 2;
+    case FieldType::INT32:
+    case FieldType::UINT32:
+        return 4;
+    case FieldType::INT64:
+        return 8;
+    }
+    return 0;
+}
+
+void aggregateField(const uint8_t *rows, size_t count, size_t stride,
+                    const FieldDesc &field, AggregateResult &acc) {
+    if (count == 0) return;
+    switch (field.type) {
+    case FieldType::INT8:
+        aggregateScalar<int8_t>(rows, count, stride, field.offset, acc);
+        break;
+    case FieldType::UINT8:
+        aggregateScalar<uint8_t>(rows, count, stride, field.offset, acc);
+        break;
+    case FieldType::INT16:
+        aggregateScalar<int16_t>(rows, count, stride, field.offset, acc);
+        break;
+    case FieldType::UINT16:
+        aggregateScalar<uint16_t>(rows, count, stride, field.offset, acc);
+        break;
+    case FieldType::INT32:
+#ifdef AGGREGATE_HAVE_AVX2_KERNEL
+        if (cpuHasAvx2()) {
+            aggregate32Avx2<false>(rows, count, stride, field.offset, acc);
+            break;
+        }
+#endif
+        aggregateScalar<int32_t>(rows, count, stride, field.offset, acc);
+        break;
+    case FieldType::UINT32:
+#ifdef AGGREGATE_HAVE_AVX2_KERNEL
+        if (cpuHasAvx2()) {
+            aggregate32Avx2<true>(rows, count, stride, field.offset, acc);
+            break;
+        }
+#endif
+        aggregateScalar<uint32_t>(rows, count, stride, field.offset, acc);
+        break;
+    case FieldType::INT64:
+        aggregateScalar<int64_t>(rows, count, stride, field.offset, acc);
+        break;
+    }
+}
+
+int64_t readField(const uint8_t *value, const FieldDesc &field) {
+    const uint8_t *p = value + field.offset;
+    switch (field.type) {
+    case FieldType::INT8:
+        return loadField<int8_t>(p);
+    case FieldType::UINT8:
+        return loadField<uint8_t>(p);
+    case FieldType::INT16:
+        return loadField<int16_t>(p);
+    case FieldType::UINT16:
+        return loadField<uint16_t>(p);
+    case FieldType::INT32:
+        return loadField<int32_t>(p);
+    case FieldType::UINT32:
+        return loadField<uint32_t>(p);
+    case FieldType::INT64:
+        return loadField<int64_t>(p);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+// Aggregation over fixed-width integer fields stored inside values.
+// A field is described by its byte offset within the value and its type;
+// kernels walk an array of equally spaced values without copying them out.
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum class FieldType : uint8_t {
+    INT8,
+    UINT8,
+    INT16,
+    UINT16,
+    INT32,
+    UINT32,
+    INT64
+};
+
+struct FieldDesc {
+    uint32_t offset; // byte offset inside the value
+    FieldType type;
+};
+
+// Size in bytes of a field of the given type
+uint32_t fieldWidth(FieldType type);
+
+struct AggregateResult {
+    uint64_t count = 0;
+    int64_t sum = 0; // wraps (mod 2^64) on overflow
+    int64_t min = INT64_MAX;
+    int64_t max = INT64_MIN;
+};
+
+// Folds the field of 'count' values, 'stride' bytes apart starting at
+// 'rows', into acc. 32-bit fields use AVX2 gathers when the CPU has them.
+void aggregateField(const uint8_t *rows, size_t count, size_t stride,
+                    const FieldDesc &field, AggregateResult &acc);
+
+// Reads the field from a single value, widened to 64 bits.
+int64_t readField(const uint8_t *value, const FieldDesc &field);
+
+#endif // AGGREGATE_H
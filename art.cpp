@@ -0,0 +1,331 @@
+// Adaptive radix tree implementation
+
+#include "art.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+enum NodeKind : uint8_t { NODE4 = 0, NODE16 = 1, NODE48 = 2, NODE256 = 3 };
+
+} // namespace
+
+struct AdaptiveRadixTree::Leaf {
+    uint32_t key; // encoded key
+    uint32_t value;
+};
+
+struct AdaptiveRadixTree::Node {
+    uint8_t kind;
+    uint16_t count;
+};
+
+struct AdaptiveRadixTree::Node4 : Node {
+    uint8_t keys[4];
+    Child children[4];
+};
+
+struct AdaptiveRadixTree::Node16 : Node {
+    uint8_t keys[16];
+    Child children[16];
+};
+
+struct AdaptiveRadixTree::Node48 : Node {
+    uint8_t index[256]; // 0 = empty, otherwise slot + 1
+    Child children[48];
+};
+
+struct AdaptiveRadixTree::Node256 : Node {
+    Child children[256];
+};
+
+AdaptiveRadixTree::AdaptiveRadixTree() : m_root(0), m_size(0) {}
+
+AdaptiveRadixTree::~AdaptiveRadixTree() {
+    clear();
+}
+
+void AdaptiveRadixTree::clear() {
+    freeChild(m_root);
+    m_root = 0;
+    m_size = 0;
+}
+
+void AdaptiveRadixTree::freeChild(Child c) {
+    if (c == 0) return;
+    if (isLeaf(c)) {
+        delete asLeaf(c);
+        return;
+    }
+    Node *n = asNode(c);
+    switch (n->kind) {
+    case NODE4: {
+        Node4 *n4 = static_cast<Node4 *>(n);
+        for (uint16_t i = 0; i < n4->count; ++i) freeChild(n4->children[i]);
+        delete n4;
+        break;
+    }
+    case NODE16: {
+        Node16 *n16 = static_cast<Node16 *>(n);
+        for (uint16_t i = 0; i < n16->count; ++i) freeChild(n16->children[i]);
+        delete n16;
+        break;
+    }
+    case NODE48: {
+        Node48 *n48 = static_cast<Node48 *>(n);
+        for (uint16_t i = 0; i < n48->count; ++i) freeChild(n48->children[i]);
+        delete n48;
+        break;
+    }
+    default: {
+        Node256 *n256 = static_cast<Node256 *>(n);
+        for (Child ch : n256->children) freeChild(ch);
+        delete n256;
+        break;
+    }
+    }
+}
+
+AdaptiveRadixTree::Child *AdaptiveRadixTree::findChild(Node *n, uint8_t b) {
+    switch (n->kind) {
+    case NODE4: {
+        Node4 *n4 = static_cast<Node4 *>(n);
+        for (uint16_t i = 0; i < n4->count; ++i) {
+            if (n4->keys[i] == b) return &n4->children[i];
+        }
+        return nullptr;
+    }
+    case NODE16: {
+        Node16 *n16 = static_cast<Node16 *>(n);
+#if defined(__SSE2__)
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(b)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i *>(n16->keys)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(cmp)) & ((1u << n16->count) - 1);
+        if (mask == 0) return nullptr;
+        return &n16->children[__builtin_ctz(mask)];
+#else
+        for (uint16_t i = 0; i < n16->count; ++i) {
+            if (n16->keys[i] == b) return &n16->children[i];
+        }
+        return nullptr;
+#endif
+    }
+    case NODE48: {
+        Node48 *n48 = static_cast<Node48 *>(n);
+        if (n48->index[b] == 0) return nullptr;
+        return &n48->children[n48->index[b] - 1];
+    }
+    default: {
+        Node256 *n256 = static_cast<Node256 *>(n);
+        if (n256->children[b] == 0) return nullptr;
+        return &n256->children[b];
+    }
+    }
+}
+
+AdaptiveRadixTree::Child AdaptiveRadixTree::findChild(const Node *n, uint8_t b) {
+    Child *c = findChild(const_cast<Node *>(n), b);
+    return c ? *c : 0;
+}
+
+AdaptiveRadixTree::Child AdaptiveRadixTree::maxChildBelow(const Node *n, uint8_t b) {
+    switch (n->kind) {
+    case NODE4: {
+        const Node4 *n4 = static_cast<const Node4 *>(n);
+        for (int i = n4->count - 1; i >= 0; --i) {
+            if (n4->keys[i] < b) return n4->children[i];
+        }
+        return 0;
+    }
+    case NODE16: {
+        const Node16 *n16 = static_cast<const Node16 *>(n);
+        for (int i = n16->count - 1; i >= 0; --i) {
+            if (n16->keys[i] < b) return n16->children[i];
+        }
+        return 0;
+    }
+    case NODE48: {
+        const Node48 *n48 = static_cast<const Node48 *>(n);
+        for (int c = static_cast<int>(b) - 1; c >= 0; --c) {
+            if (n48->index[c] != 0) return n48->children[n48->index[c] - 1];
+        }
+        return 0;
+    }
+    default: {
+        const Node256 *n256 = static_cast<const Node256 *>(n);
+        for (int c = static_cast<int>(b) - 1; c >= 0; --c) {
+            if (n256->children[c] != 0) return n256->children[c];
+        }
+        return 0;
+    }
+    }
+}
+
+const AdaptiveRadixTree::Leaf *AdaptiveRadixTree::maximum(Child c) {
+    while (c != 0 && !isLeaf(c)) {
+        const Node *n = asNode(c);
+        Child last = findChild(n, 0xFF);
+        c = last != 0 ? last : maxChildBelow(n, 0xFF);
+    }
+    return c ? asLeaf(c) : nullptr;
+}
+
+void AdaptiveRadixTree::addChild(Child &slot, uint8_t b, Child child) {
+    Node *n = asNode(slot);
+    switch (n->kind) {
+    case NODE4: {
+        Node4 *n4 = static_cast<Node4 *>(n);
+        if (n4->count == 4) {
+            Node16 *n16 = new Node16();
+            n16->kind = NODE16;
+            n16->count = n4->count;
+            std::memcpy(n16->keys, n4->keys, sizeof(n4->keys));
+            std::memcpy(n16->children, n4->children, sizeof(n4->children));
+            delete n4;
+            slot = fromNode(n16);
+            addChild(slot, b, child);
+            return;
+        }
+        uint16_t pos = 0;
+        while (pos < n4->count && n4->keys[pos] < b) ++pos;
+        for (uint16_t i = n4->count; i > pos; --i) {
+            n4->keys[i] = n4->keys[i - 1];
+            n4->children[i] = n4->children[i - 1];
+        }
+        n4->keys[pos] = b;
+        n4->children[pos] = child;
+        ++n4->count;
+        return;
+    }
+    case NODE16: {
+        Node16 *n16 = static_cast<Node16 *>(n);
+        if (n16->count == 16) {
+            Node48 *n48 = new Node48();
+            n48->kind = NODE48;
+            n48->count = n16->count;
+            for (uint16_t i = 0; i < n16->count; ++i) {
+                n48->index[n16->keys[i]] = static_cast<uint8_t>(i + 1);
+                n48->children[i] = n16->children[i];
+            }
+            delete n16;
+            slot = fromNode(n48);
+            addChild(slot, b, child);
+            return;
+        }
+        uint16_t pos = 0;
+        while (pos < n16->count && n16->keys[pos] < b) ++pos;
+        for (uint16_t i = n16->count; i > pos; --i) {
+            n16->keys[i] = n16->keys[i - 1];
+            n16->children[i] = n16->children[i - 1];
+        }
+        n16->keys[pos] = b;
+        n16->children[pos] = child;
+        ++n16->count;
+        return;
+    }
+    case NODE48: {
+        Node48 *n48 = static_cast<Node48 *>(n);
+        if (n48->count == 48) {
+            Node256 *n256 = new Node256();
+            n256->kind = NODE256;
+            n256->count = n48->count;
+            for (int c = 0; c < 256; ++c) {
+                if (n48->index[c] != 0) n256->children[c] = n48->children[n48->index[c] - 1];
+            }
+            delete n48;
+            slot = fromNode(n256);
+            addChild(slot, b, child);
+            return;
+        }
+        n48->children[n48->count] = child;
+        n48->index[b] = static_cast<uint8_t>(n48->count + 1);
+        ++n48->count;
+        return;
+    }
+    default: {
+        Node256 *n256 = static_cast<Node256 *>(n);
+        n256->children[b] = child;
+        ++n256->count;
+        return;
+    }
+    }
+}
+
+void AdaptiveRadixTree::insert(int32_t key, uint32_t value) {
+    uint32_t k = encode(key);
+    Child *slot = &m_root;
+    unsigned depth = 0;
+    while (true) {
+        if (*slot == 0) {
+            *slot = fromLeaf(new Leaf{k, value});
+            ++m_size;
+            return;
+        }
+        if (isLeaf(*slot)) {
+            Leaf *existing = asLeaf(*slot);
+            if (existing->key == k) {
+                existing->value = value;
+                return;
+            }
+            // Lazy expansion: push the existing leaf down until the keys diverge
+            Child old = *slot;
+            while (true) {
+                Node4 *n4 = new Node4();
+                n4->kind = NODE4;
+                n4->count = 0;
+                *slot = fromNode(n4);
+                uint8_t a = byteAt(existing->key, depth);
+                uint8_t b = byteAt(k, depth);
+                if (a != b) {
+                    addChild(*slot, a, old);
+                    addChild(*slot, b, fromLeaf(new Leaf{k, value}));
+                    ++m_size;
+                    return;
+                }
+                n4->keys[0] = a;
+                n4->children[0] = 0;
+                n4->count = 1;
+                slot = &n4->children[0];
+                ++depth;
+            }
+        }
+        Node *n = asNode(*slot);
+        uint8_t b = byteAt(k, depth);
+        Child *next = findChild(n, b);
+        if (!next) {
+            addChild(*slot, b, fromLeaf(new Leaf{k, value}));
+            ++m_size;
+            return;
+        }
+        slot = next;
+        ++depth;
+    }
+}
+
+const AdaptiveRadixTree::Leaf *AdaptiveRadixTree::floorRec(Child c, unsigned depth, uint32_t k) {
+    if (c == 0) return nullptr;
+    if (isLeaf(c)) {
+        const Leaf *l = asLeaf(c);
+        return l->key <= k ? l : nullptr;
+    }
+    const Node *n = asNode(c);
+    uint8_t b = byteAt(k, depth);
+    Child exact = findChild(n, b);
+    if (exact != 0) {
+        const Leaf *l = floorRec(exact, depth + 1, k);
+        if (l) return l;
+    }
+    Child below = maxChildBelow(n, b);
+    return below ? maximum(below) : nullptr;
+}
+
+bool AdaptiveRadixTree::floor(int32_t key, uint32_t &value) const {
+    const Leaf *l = floorRec(m_root, 0, encode(key));
+    if (!l) return false;
+    value = l->value;
+    return true;
+}
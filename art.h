@@ -0,0 +1,69 @@
+// Adaptive radix tree (ART) over 32-bit signed integer keys.
+// Keys are split into 4 bytes (most significant first, sign bit flipped so
+// byte order matches integer order). Inner nodes grow through the four ART
+// node sizes (4, 16, 48, 256 children); a subtree holding a single key is
+// stored as a leaf directly in its parent slot (lazy expansion).
+// Used by BPlusTree to map key ranges to subtree pages; supports insert and
+// floor (greatest key <= x) lookups.
+
+#ifndef ART_H
+#define ART_H
+
+#include <cstddef>
+#include <cstdint>
+
+class AdaptiveRadixTree {
+public:
+    AdaptiveRadixTree();
+    ~AdaptiveRadixTree();
+
+    // disable copy
+    AdaptiveRadixTree(const AdaptiveRadixTree &) = delete;
+    AdaptiveRadixTree &operator=(const AdaptiveRadixTree &) = delete;
+
+    // Inserts key or replaces its value.
+    void insert(int32_t key, uint32_t value);
+
+    // Finds the greatest key <= key. Returns false if there is none.
+    bool floor(int32_t key, uint32_t &value) const;
+
+    void clear();
+    size_t size() const { return m_size; }
+
+private:
+    struct Leaf;
+    struct Node;
+    struct Node4;
+    struct Node16;
+    struct Node48;
+    struct Node256;
+
+    // A child slot holds either a Node* or a Leaf* tagged with the low bit.
+    using Child = uintptr_t;
+
+    static bool isLeaf(Child c) { return (c & 1u) != 0; }
+    static Leaf *asLeaf(Child c) { return reinterpret_cast<Leaf *>(c & ~static_cast<Child>(1)); }
+    static Node *asNode(Child c) { return reinterpret_cast<Node *>(c); }
+    static Child fromLeaf(Leaf *l) { return reinterpret_cast<Child>(l) | 1u; }
+    static Child fromNode(Node *n) { return reinterpret_cast<Child>(n); }
+
+    static uint32_t encode(int32_t key) { return static_cast<uint32_t>(key) ^ 0x80000000u; }
+    static uint8_t byteAt(uint32_t k, unsigned depth) {
+        return static_cast<uint8_t>(k >> (24 - 8 * depth));
+    }
+
+    static Child *findChild(Node *n, uint8_t b);
+    static Child findChild(const Node *n, uint8_t b);
+    // greatest child with byte < b, or 0
+    static Child maxChildBelow(const Node *n, uint8_t b);
+    static const Leaf *maximum(Child c);
+    static void addChild(Child &slot, uint8_t b, Child child);
+    static void freeChild(Child c);
+
+    static const Leaf *floorRec(Child c, unsigned depth, uint32_t k);
+
+    Child m_root;
+    size_t m_size;
+};
+
+#endif // ART_H
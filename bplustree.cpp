@@ -3,48 +3,311 @@
 #include "bplustree.h"
 
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
 #include <algorithm>
 #include <array>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <random>
 
 namespace {
 
 constexpr uint32_t MAGIC = 0x42505431u; // "BPT1"
 
+// Warm-up list file: magic, count, then count page ids
+constexpr uint32_t WARM_MAGIC = 0x42505457u; // "BPTW"
+// How often the hot page list is rewritten while the tree is in use
+constexpr std::chrono::seconds HOT_SAVE_INTERVAL(60);
+// Prefetch reads coalesce page ids closer than this into one read ...
+constexpr uint32_t WARM_MAX_GAP_PAGES = 8;
+// ... of at most this many pages (1 MiB)
+constexpr uint32_t WARM_MAX_RUN_PAGES = 256;
+
 bool fileExists(const std::string &path) {
     struct stat st;
     return ::stat(path.c_str(), &st) == 0;
 }
 
+// Histogram shape: at most this many buckets, built from the fill of
+// this many sampled leaves; rebuilt once the tree has seen more than
+// max(HISTOGRAM_MIN_STALE, 10% of the estimated keys) modifications
+constexpr size_t HISTOGRAM_BUCKETS = 256;
+constexpr size_t HISTOGRAM_SAMPLE_LEAVES = 32;
+constexpr uint64_t HISTOGRAM_MIN_STALE = 1000;
+
+// Write batch journal: a sequence of records, each a JournalRecord
+// followed by pageCount entries of (page id, page image)
+constexpr uint32_t JOURNAL_MAGIC = 0x4250544au; // "BPTJ"
+// A record with this magic has no entries: replaying it truncates the file
+// to pageCount pages. Its checksum covers the page count.
+constexpr uint32_t JOURNAL_TRUNCATE_MAGIC = 0x42505454u; // "BPTT"
+constexpr size_t JOURNAL_ENTRY_SIZE = sizeof(uint32_t) + PAGE_SIZE;
+// The journal is checkpointed once it grows past this size (64 MiB)
+constexpr uint64_t JOURNAL_CHECKPOINT_BYTES = 64ull << 20;
+
+struct JournalRecord {
+    uint32_t magic;
+    uint32_t pageCount;
+    uint64_t checksum; // FNV-1a over the entries
+};
+
+uint64_t journalChecksum(const uint8_t *data, size_t size, uint64_t h = 0xcbf29ce484222325ull) {
+    for (size_t i = 0; i < size; ++i) {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// checkIntegrity splits the tree into about this many subtrees per thread
+constexpr size_t CHECK_TASKS_PER_THREAD = 4;
+// and reports at most this many problems per subtree
+constexpr size_t CHECK_MAX_ERRORS = 100;
+
+// scanPhysical reads the file this many pages (1 MiB) at a time
+constexpr uint32_t PHYSICAL_SCAN_CHUNK_PAGES = 256;
+
+// Online backups copy the file this many pages (128 KiB) at a time
+constexpr uint32_t BACKUP_CHUNK_PAGES = 32;
+// A throttled backup checks for cancellation at least this often
+constexpr std::chrono::milliseconds BACKUP_MAX_SLEEP(100);
+
+// Incremental backup stream: an IncrementalHeader, entries laid out like
+// journal entries (page id, page image), an INVALID_PAGE id ending the
+// list, then the journal checksum of all entries
+constexpr uint32_t INCREMENTAL_MAGIC = 0x42505449u; // "BPTI"
+
+struct IncrementalHeader {
+    uint32_t magic;
+    uint32_t pageSize;
+    uint64_t sinceLsn; // pages with a higher LSN are included
+    uint64_t endLsn;   // lastLsn() of the source when the backup started
+    uint32_t pageCount; // size of the source in pages when the backup started
+    uint32_t reserved;
+};
+
+// Change log file for read replicas
+constexpr uint32_t CHANGE_LOG_MAGIC = 0x42505443u; // "BPTC"
+// applyChangeLog reads this many records (512 KiB) at a time and applies
+// the complete writes among them as one batch
+constexpr size_t CHANGE_APPLY_RECORDS = 4096;
+
+// clone() gives each copy worker at least this many bytes (64 MiB)
+constexpr uint64_t CLONE_MIN_CHUNK_BYTES = 64ull << 20;
+// and copies through a buffer of this size where the kernel cannot copy
+constexpr size_t CLONE_BUFFER_BYTES = 1u << 20;
+
+// Copies [off, off + size) from inFd to the same place in outFd, inside
+// the kernel where the file systems allow it
+bool copyRange(int inFd, int outFd, uint64_t off, uint64_t size) {
+#ifdef __linux__
+    loff_t in = static_cast<loff_t>(off);
+    loff_t out = static_cast<loff_t>(off);
+    while (size > 0) {
+        ssize_t n = ::copy_file_range(inFd, &in, outFd, &out, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // not supported between these files: copy the rest by hand
+        size -= static_cast<uint64_t>(n);
+    }
+    off = static_cast<uint64_t>(in);
+#endif
+    std::vector<uint8_t> buf(static_cast<size_t>(std::min<uint64_t>(size, CLONE_BUFFER_BYTES)));
+    while (size > 0) {
+        size_t len = static_cast<size_t>(std::min<uint64_t>(size, buf.size()));
+        ssize_t n = ::pread(inFd, buf.data(), len, static_cast<off_t>(off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || ::pwrite(outFd, buf.data(), static_cast<size_t>(n), static_cast<off_t>(off)) != n) {
+            return false;
+        }
+        off += static_cast<uint64_t>(n);
+        size -= static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// Makes outFd a copy of inFd: a reflink sharing its blocks if possible,
+// otherwise chunks copied by up to 'threads' workers
+bool copyFile(int inFd, int outFd, unsigned threads) {
+#ifdef FICLONE
+    if (::ioctl(outFd, FICLONE, inFd) == 0) return true;
+#endif
+    off_t end = lseek(inFd, 0, SEEK_END);
+    if (end < 0 || ::ftruncate(outFd, end) != 0) return false;
+    const uint64_t size = static_cast<uint64_t>(end);
+    const uint64_t chunks = std::max<uint64_t>(1, std::min<uint64_t>(threads, size / CLONE_MIN_CHUNK_BYTES));
+    const uint64_t chunk = (size + chunks - 1) / chunks;
+    std::atomic<bool> ok(true);
+    auto worker = [&](uint64_t c) {
+        uint64_t off = c * chunk;
+        if (off < size && !copyRange(inFd, outFd, off, std::min(chunk, size - off))) ok = false;
+    };
+    std::vector<std::thread> pool;
+    for (uint64_t c = 1; c < chunks; ++c) pool.emplace_back(worker, c);
+    worker(0);
+    for (std::thread &t : pool) t.join();
+    return ok;
+}
+
+// merge() applies an in-place merge in write batches of this many records
+constexpr size_t MERGE_BATCH_RECORDS = 16384;
+// An in-place merge costs about this many times more per leaf it touches
+// (random read, journal write, write in place) than a rebuild per leaf
+// (sequential read and write), so it rebuilds beyond 1/6 of the leaves
+constexpr uint64_t MERGE_REBUILD_RATIO = 6;
+// A rebuilt file fills its nodes to this percentage, leaving room for a few
+// inserts per leaf before it splits (frozen copies are 100% full)
+constexpr uint32_t MERGE_REBUILD_FILL_PERCENT = 90;
+
+// Page LSNs are reserved this many at a time, one header sync per block
+constexpr uint64_t LSN_RESERVE_BLOCK = 1ull << 16;
+
+bool writeAll(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool readAll(int fd, void *data, size_t size) {
+    uint8_t *p = static_cast<uint8_t *>(data);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// sampleRecords gives up after this many rejected descents per requested record
+constexpr uint64_t SAMPLE_MAX_ATTEMPTS_PER_RECORD = 1000;
+
+// In-order walk of the implicit binary tree rooted at slot k: assigns the
+// sorted keys starting at index i to BFS slots. Returns the next unused index.
+uint32_t fillEytzinger(int32_t *out, uint8_t *rank, const int32_t *sorted,
+                       uint32_t n, uint32_t i, uint32_t k) {
+    if (k > n) return i;
+    i = fillEytzinger(out, rank, sorted, n, i, 2 * k);
+    out[k] = sorted[i];
+    rank[k] = static_cast<uint8_t>(i);
+    return fillEytzinger(out, rank, sorted, n, i + 1, 2 * k + 1);
+}
+
 } // namespace
 
-BPlusTree::BPlusTree(const std::string &filename)
-    : m_fd(-1), m_filename(filename), m_ok(false) {
+BPlusTree::BPlusTree(const std::string &filename, size_t cachePages, size_t cacheRecords)
+    : m_fd(-1), m_filename(filename), m_ok(false), m_readOnly(false),
+      m_map(nullptr), m_mapSize(0), m_walFd(-1), m_walSize(0), m_batchActive(false),
+      m_batchNextPage(0), m_cache(cachePages, PAGE_SIZE),
+      m_recordCache(cacheRecords, VALUE_SIZE), m_warmStop(false), m_warmDone(true),
+      m_hotSaveStop(false), m_backupActive(false),
+      m_backupStop(false), m_backupOk(false), m_backupIncremental(false), m_backupSinceLsn(0),
+      m_backupEndLsn(0), m_backupChangeSeq(0), m_backupPages(0), m_nextLsn(1), m_changeFd(-1),
+      m_height(1),
+      m_radixEnabled(false), m_radixLevel(0), m_histogramMods(0) {
     m_ok = openFile(filename);
     if (!m_ok) return;
+    bool replayed = false;
+    if (!m_readOnly) {
+        m_ok = recoverJournal(replayed);
+        if (!m_ok) return;
+    }
 
     if (!fileExists(filename) || lseek(m_fd, 0, SEEK_END) == 0) {
         // New file or empty file: initialize header and empty tree
+        if (m_readOnly) {
+            m_ok = false;
+            return;
+        }
         initEmptyTree();
     } else {
         m_ok = loadHeader();
+        if (m_ok && (m_header.flags & FILE_FLAG_FROZEN)) {
+            m_readOnly = true;
+            m_ok = mapFile();
+        }
+        m_ok = m_ok && computeHeight();
+        const bool unclean = m_ok && (m_header.flags & FILE_FLAG_OPEN);
+        if (unclean && !m_readOnly) {
+            // not closed cleanly last time: validate before trusting the file
+            std::vector<std::string> errors;
+            std::vector<uint32_t> unreachable;
+            if (!checkFile(0, &errors, &unreachable)) {
+                for (const std::string &e : errors) std::cerr << e << "\n";
+                std::cerr << "Index file failed its integrity check, opening read-only\n";
+                m_readOnly = true;
+            } else if (!unreachable.empty()) {
+                // pages allocated by writes the crash interrupted
+                std::cerr << "Warning: reclaiming " << unreachable.size()
+                          << " unreachable pages left by an unclean shutdown\n";
+                m_ok = freePages(unreachable);
+            }
+        }
+        m_ok = m_ok && openIndexes();
+        // secondary indexes may lag behind a replayed batch, or miss the
+        // last write before a crash (they are updated after the tree)
+        for (uint32_t i = 0; m_ok && (replayed || unclean) && i < m_indexes.size(); ++i) {
+            m_ok = buildIndex(i);
+        }
+        if (m_ok && !m_readOnly && (m_header.flags & FILE_FLAG_CHANGE_LOG)) {
+            // writes must keep reaching the log replicas follow
+            std::string logFile(m_header.changeLogPath,
+                                strnlen(m_header.changeLogPath, CHANGE_LOG_PATH_MAX));
+            if (!enableChangeLog(logFile)) {
+                std::cerr << "Cannot reopen change log " << logFile << ", opening read-only\n";
+                m_readOnly = true;
+            }
+        }
+        if (m_ok && !m_map) startWarmup();
     }
+    if (m_ok && !m_readOnly) m_ok = setOpenFlag(true);
+    if (m_ok && !m_map) startHotSaver();
 }
 
 BPlusTree::~BPlusTree() {
+    stopBackup();
+    stopWarmup();
+    stopHotSaver();
     if (m_fd >= 0) {
-        flushHeader();
+        if (m_ok && !m_map) saveHotPages();
+        // after a failure the journal may hold committed pages that never
+        // reached the file: keep it for the next open to replay
+        if (!m_readOnly && m_ok) {
+            flushHeader();
+            checkpointJournal();
+            // mark the file clean only once everything before is on disk
+            if (::fsync(m_fd) == 0) setOpenFlag(false);
+        }
         closeFile();
     }
 }
 
 bool BPlusTree::openFile(const std::string &filename) {
     m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0 && (errno == EACCES || errno == EROFS) && fileExists(filename)) {
+        // read-only file or file system: serve reads only
+        m_fd = ::open(filename.c_str(), O_RDONLY);
+        m_readOnly = m_fd >= 0;
+    }
     if (m_fd < 0) {
         perror("open");
         return false;
@@ -52,31 +315,161 @@ bool BPlusTree::openFile(const std::string &filename) {
     return true;
 }
 
+bool BPlusTree::mapFile() {
+    off_t size = lseek(m_fd, 0, SEEK_END);
+    if (size < static_cast<off_t>(PAGE_SIZE)) return false;
+    void *p = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    m_map = static_cast<const uint8_t *>(p);
+    m_mapSize = static_cast<size_t>(size);
+    size_t pages = m_mapSize / PAGE_SIZE;
+    m_mapVerified.reset(new std::atomic<bool>[pages]);
+    for (size_t i = 0; i < pages; ++i) m_mapVerified[i] = false;
+    return true;
+}
+
 void BPlusTree::closeFile() {
+    if (m_map) {
+        ::munmap(const_cast<uint8_t *>(m_map), m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
     if (m_fd >= 0) {
         ::close(m_fd);
         m_fd = -1;
     }
+    if (m_walFd >= 0) {
+        ::close(m_walFd);
+        m_walFd = -1;
+    }
+    closeChangeLog();
 }
 
 bool BPlusTree::readPage(uint32_t pageId, void *page) {
+    if (m_map) {
+        // frozen index: the mapping is the cache
+        if (pageOffset(pageId) + PAGE_SIZE > m_mapSize) return false;
+        const uint8_t *mapped = m_map + pageOffset(pageId);
+        if (!m_mapVerified[pageId]) {
+            if (!verifyPage(pageId, mapped)) return false;
+            m_mapVerified[pageId] = true;
+        }
+        std::memcpy(page, mapped, PAGE_SIZE);
+        return true;
+    }
+    if (m_batchActive) {
+        // pages changed by the batch being applied
+        auto it = m_batchPages.find(pageId);
+        if (it != m_batchPages.end()) {
+            std::memcpy(page, it->second.data(), PAGE_SIZE);
+            return true;
+        }
+    }
+    if (m_cache.get(pageId, page)) return true;
     uint64_t off = pageOffset(pageId);
-    if (lseek(m_fd, static_cast<off_t>(off), SEEK_SET) < 0) return false;
-    ssize_t n = ::read(m_fd, page, PAGE_SIZE);
+    ssize_t n = ::pread(m_fd, page, PAGE_SIZE, static_cast<off_t>(off));
     if (n != static_cast<ssize_t>(PAGE_SIZE)) return false;
+    // cached copies were verified (or stamped) when they entered the cache
+    if (!verifyPage(pageId, static_cast<const uint8_t *>(page))) return false;
+    m_cache.put(pageId, page);
     return true;
 }
 
-bool BPlusTree::writePage(uint32_t pageId, const void *page) {
+bool BPlusTree::writePage(uint32_t pageId, void *page) {
+    if (m_readOnly) return false;
+    m_searchNodes.erase(pageId);
+    if (pageId != 0 && !stampLsn(static_cast<uint8_t *>(page))) return false;
+    if (checksumsEnabled() && pageId != 0) stampChecksum(static_cast<uint8_t *>(page));
+    if (m_batchActive) {
+        std::memcpy(m_batchPages[pageId].data(), page, PAGE_SIZE);
+        m_cache.put(pageId, page);
+        return true;
+    }
+    // journaled pages must be durable before anything overwrites them in place
+    if (!checkpointJournal()) return false;
+    preserveForBackup(pageId);
     uint64_t off = pageOffset(pageId);
-    if (lseek(m_fd, static_cast<off_t>(off), SEEK_SET) < 0) return false;
-    ssize_t n = ::write(m_fd, page, PAGE_SIZE);
-    if (n != static_cast<ssize_t>(PAGE_SIZE)) return false;
+    ssize_t n = ::pwrite(m_fd, page, PAGE_SIZE, static_cast<off_t>(off));
+    if (n != static_cast<ssize_t>(PAGE_SIZE)) {
+        // the on-disk page is now unknown; don't serve a stale copy
+        m_cache.erase(pageId);
+        return false;
+    }
+    m_cache.put(pageId, page);
+    return true;
+}
+
+uint32_t BPlusTree::pageChecksum(const uint8_t *page) {
+    static const uint8_t zero[sizeof(uint32_t)] = {};
+    const size_t at = offsetof(NodeHeader, checksum);
+    uint32_t crc = crc32c(page, at);
+    crc = crc32c(zero, sizeof(zero), crc);
+    return crc32c(page + at + sizeof(uint32_t), PAGE_SIZE - at - sizeof(uint32_t), crc);
+}
+
+void BPlusTree::stampChecksum(uint8_t *page) {
+    uint32_t crc = pageChecksum(page);
+    std::memcpy(page + offsetof(NodeHeader, checksum), &crc, sizeof(crc));
+}
+
+bool BPlusTree::stampLsn(uint8_t *page) {
+    if (m_nextLsn >= m_header.lsnLimit && !reserveLsns()) return false;
+    uint64_t lsn = m_nextLsn++;
+    std::memcpy(page + PAGE_LSN_OFFSET, &lsn, sizeof(lsn));
     return true;
 }
 
+bool BPlusTree::reserveLsns() {
+    m_header.lsnLimit = m_nextLsn + LSN_RESERVE_BLOCK;
+    // the block must be on disk before a page carries one of its numbers;
+    // inside a batch the header is journaled with the pages
+    return flushHeader() && (m_batchActive || ::fdatasync(m_fd) == 0);
+}
+
+uint64_t BPlusTree::pageLsn(const uint8_t *page) {
+    uint64_t lsn = 0;
+    std::memcpy(&lsn, page + PAGE_LSN_OFFSET, sizeof(lsn));
+    return lsn;
+}
+
+bool BPlusTree::checksumMatches(uint32_t pageId, const uint8_t *page) const {
+    if (!checksumsEnabled() || pageId == 0) return true;
+    uint32_t stored = 0;
+    std::memcpy(&stored, page + offsetof(NodeHeader, checksum), sizeof(stored));
+    return stored == pageChecksum(page);
+}
+
+bool BPlusTree::verifyPage(uint32_t pageId, const uint8_t *page) const {
+    if (checksumMatches(pageId, page)) return true;
+    std::cerr << "Checksum mismatch on page " << pageId << "\n";
+    return false;
+}
+
 uint32_t BPlusTree::allocatePage() {
-    // Simple allocator: append at end; ignore free list for now
+    if (m_header.freeListHead != INVALID_PAGE) {
+        // the header stops listing the page before it is used, so a crash
+        // can leak it but never hand it out twice
+        uint32_t pageId = m_header.freeListHead;
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        if (!readPage(pageId, buf.data())) return INVALID_PAGE;
+        FreePage node{};
+        std::memcpy(&node, buf.data(), sizeof(node));
+        if (node.hdr.type != static_cast<uint8_t>(NodeType::FREE)) return INVALID_PAGE;
+        m_header.freeListHead = node.nextFree;
+        std::array<uint8_t, PAGE_SIZE> zero{};
+        if (!flushHeader() || !writePage(pageId, zero.data())) return INVALID_PAGE;
+        return pageId;
+    }
+    // otherwise append at the end
+    if (m_batchActive) {
+        std::array<uint8_t, PAGE_SIZE> zero{};
+        uint32_t pageId = m_batchNextPage++;
+        writePage(pageId, zero.data());
+        return pageId;
+    }
     off_t end = lseek(m_fd, 0, SEEK_END);
     if (end < 0) return INVALID_PAGE;
     uint32_t pageId = static_cast<uint32_t>(end / PAGE_SIZE);
@@ -86,12 +479,27 @@ uint32_t BPlusTree::allocatePage() {
     return pageId;
 }
 
+bool BPlusTree::freePages(const std::vector<uint32_t> &pages) {
+    for (uint32_t pageId : pages) {
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        FreePage node{};
+        node.hdr.type = static_cast<uint8_t>(NodeType::FREE);
+        node.nextFree = m_header.freeListHead;
+        std::memcpy(buf.data(), &node, sizeof(node));
+        if (!writePage(pageId, buf.data())) return false;
+        m_header.freeListHead = pageId;
+    }
+    // until the header is written the pages are merely unreachable again
+    return flushHeader();
+}
+
 void BPlusTree::initEmptyTree() {
     // Initialize header
     std::memset(&m_header, 0, sizeof(m_header));
     m_header.magic = MAGIC;
     m_header.pageSize = PAGE_SIZE;
     m_header.freeListHead = INVALID_PAGE;
+    m_header.flags = FILE_FLAG_CHECKSUMS;
 
     // Page 0 is header
     std::array<uint8_t, PAGE_SIZE> page0{};
@@ -120,6 +528,7 @@ bool BPlusTree::loadHeader() {
         std::cerr << "Invalid index file header\n";
         return false;
     }
+    m_nextLsn = std::max<uint64_t>(1, m_header.lsnLimit);
     return true;
 }
 
@@ -129,6 +538,195 @@ bool BPlusTree::flushHeader() {
     return writePage(0, buf.data());
 }
 
+bool BPlusTree::saveHotPages() {
+    if (!isOk() || m_map) return false;
+    return writeHotPages();
+}
+
+bool BPlusTree::writeHotPages() {
+    // the saver thread and saveHotPages share the temporary file
+    std::lock_guard<std::mutex> lock(m_hotSaveMutex);
+    std::vector<uint32_t> pages = m_cache.hotPages(m_cache.capacity());
+
+    // write to a temporary file and rename so a crash never leaves a torn list
+    std::string tmpName = warmFileName() + ".tmp";
+    FILE *f = std::fopen(tmpName.c_str(), "wb");
+    if (!f) return false;
+    uint32_t hdr[2] = {WARM_MAGIC, static_cast<uint32_t>(pages.size())};
+    bool ok = std::fwrite(hdr, sizeof(hdr), 1, f) == 1;
+    if (ok && !pages.empty()) {
+        ok = std::fwrite(pages.data(), sizeof(uint32_t), pages.size(), f) == pages.size();
+    }
+    if (std::fclose(f) != 0) ok = false;
+    if (!ok || std::rename(tmpName.c_str(), warmFileName().c_str()) != 0) {
+        std::remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+void BPlusTree::startHotSaver() {
+    if (m_cache.capacity() == 0) return;
+    m_hotSaveStop = false;
+    m_hotSaveThread = std::thread(&BPlusTree::hotSaveWorker, this);
+}
+
+void BPlusTree::stopHotSaver() {
+    {
+        std::lock_guard<std::mutex> lock(m_hotSaveMutex);
+        m_hotSaveStop = true;
+    }
+    m_hotSaveCv.notify_all();
+    if (m_hotSaveThread.joinable()) m_hotSaveThread.join();
+}
+
+void BPlusTree::hotSaveWorker() {
+    // touches only the page cache and the .warm file, never the tree
+    std::unique_lock<std::mutex> lock(m_hotSaveMutex);
+    while (!m_hotSaveCv.wait_for(lock, HOT_SAVE_INTERVAL, [this] { return m_hotSaveStop; })) {
+        lock.unlock();
+        writeHotPages();
+        lock.lock();
+    }
+}
+
+void BPlusTree::startWarmup() {
+    if (m_cache.capacity() == 0) return;
+    FILE *f = std::fopen(warmFileName().c_str(), "rb");
+    if (!f) return;
+    uint32_t hdr[2] = {0, 0};
+    std::vector<uint32_t> pages;
+    if (std::fread(hdr, sizeof(hdr), 1, f) == 1 && hdr[0] == WARM_MAGIC) {
+        pages.resize(std::min<size_t>(hdr[1], m_cache.capacity()));
+        pages.resize(std::fread(pages.data(), sizeof(uint32_t), pages.size(), f));
+    }
+    std::fclose(f);
+    if (pages.empty()) return;
+
+    m_warmDone = false;
+    m_cache.beginTracking();
+    m_warmThread = std::thread(&BPlusTree::warmupWorker, this, std::move(pages));
+}
+
+void BPlusTree::stopWarmup() {
+    m_warmStop = true;
+    if (m_warmThread.joinable()) m_warmThread.join();
+}
+
+void BPlusTree::warmupWorker(std::vector<uint32_t> pages) {
+    // Read in page-id order, merging nearby ids into large sequential reads
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    std::vector<uint8_t> buf(static_cast<size_t>(WARM_MAX_RUN_PAGES) * PAGE_SIZE);
+    size_t i = 0;
+    while (i < pages.size() && !m_warmStop && m_cache.size() < m_cache.capacity()) {
+        uint32_t first = pages[i];
+        size_t j = i + 1;
+        while (j < pages.size() && pages[j] - pages[j - 1] <= WARM_MAX_GAP_PAGES &&
+               pages[j] - first < WARM_MAX_RUN_PAGES) {
+            ++j;
+        }
+        uint32_t runPages = pages[j - 1] - first + 1;
+        ssize_t n = ::pread(m_fd, buf.data(), static_cast<size_t>(runPages) * PAGE_SIZE,
+                            static_cast<off_t>(pageOffset(first)));
+        uint32_t got = n > 0 ? static_cast<uint32_t>(n / PAGE_SIZE) : 0;
+        for (size_t k = i; k < j; ++k) {
+            uint32_t rel = pages[k] - first;
+            if (rel >= got) break;
+            const uint8_t *page = buf.data() + static_cast<size_t>(rel) * PAGE_SIZE;
+            if (!checksumMatches(pages[k], page)) {
+                // a foreground write replacing the page while it was read
+                // is not damage: putIfUntouched would refuse the page anyway
+                if (!warmPageChanged(pages[k], page)) verifyPage(pages[k], page);
+                continue;
+            }
+            m_cache.putIfUntouched(pages[k], page);
+        }
+        i = j;
+    }
+    m_cache.endTracking();
+    m_warmDone = true;
+}
+
+bool BPlusTree::warmPageChanged(uint32_t pageId, const uint8_t *page) {
+    if (m_cache.touched(pageId)) return true;
+    // the write may still be in flight: read the page again
+    std::array<uint8_t, PAGE_SIZE> again{};
+    ssize_t n = ::pread(m_fd, again.data(), PAGE_SIZE, static_cast<off_t>(pageOffset(pageId)));
+    return n == static_cast<ssize_t>(PAGE_SIZE) && std::memcmp(again.data(), page, PAGE_SIZE) != 0;
+}
+
+bool BPlusTree::computeHeight() {
+    // all leaves are at the same depth; follow the leftmost path
+    uint32_t page = m_header.rootPage;
+    m_height = 1;
+    while (true) {
+        InternalNode node{};
+        if (!readInternal(page, node)) return false;
+        if (node.hdr.type == static_cast<uint8_t>(NodeType::LEAF)) return true;
+        page = node.children[0];
+        ++m_height;
+    }
+}
+
+void BPlusTree::setRoot(uint32_t rootPage) {
+    m_header.rootPage = rootPage;
+    ++m_height;
+    // the tree just grew a level: its new root may be the first node at the radix level
+    if (m_radixEnabled && m_height - 1 == m_radixLevel) {
+        m_radix.insert(INT32_MIN, rootPage);
+    }
+}
+
+void BPlusTree::noteSplit(uint32_t level, int32_t key, uint32_t rightPage) {
+    // a split at the radix level creates a new subtree starting at 'key'
+    if (m_radixEnabled && level == m_radixLevel) {
+        m_radix.insert(key, rightPage);
+    }
+}
+
+bool BPlusTree::enableRadixIndex(uint32_t level) {
+    if (!isOk()) return false;
+    m_radix.clear();
+    m_radixEnabled = false;
+    m_radixLevel = level;
+    if (level < m_height) {
+        std::vector<std::pair<int32_t, uint32_t>> subtrees;
+        if (!collectLevel(level, subtrees)) return false;
+        for (const auto &st : subtrees) m_radix.insert(st.first, st.second);
+    }
+    m_radixEnabled = true;
+    return true;
+}
+
+void BPlusTree::disableRadixIndex() {
+    m_radixEnabled = false;
+    m_radix.clear();
+}
+
+bool BPlusTree::collectLevel(uint32_t level, std::vector<std::pair<int32_t, uint32_t>> &out) {
+    out.clear();
+    if (level >= m_height) return false;
+    return collectLevel(m_header.rootPage, m_height - 1, level, INT32_MIN, out);
+}
+
+bool BPlusTree::collectLevel(uint32_t page, uint32_t pageLevel, uint32_t level,
+                             int32_t lowerKey,
+                             std::vector<std::pair<int32_t, uint32_t>> &out) {
+    if (pageLevel == level) {
+        out.emplace_back(lowerKey, page);
+        return true;
+    }
+    InternalNode node{};
+    if (!readInternal(page, node)) return false;
+    for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) {
+        int32_t childLower = i == 0 ? lowerKey : node.keys[i - 1];
+        if (!collectLevel(node.children[i], pageLevel - 1, level, childLower, out)) return false;
+    }
+    return true;
+}
+
 bool BPlusTree::readInternal(uint32_t pageId, InternalNode &node) {
     std::array<uint8_t, PAGE_SIZE> buf{};
     if (!readPage(pageId, buf.data())) return false;
@@ -146,7 +744,41 @@ bool BPlusTree::readLeaf(uint32_t pageId, LeafNode &node) {
 bool BPlusTree::writeInternal(uint32_t pageId, const InternalNode &node) {
     std::array<uint8_t, PAGE_SIZE> buf{};
     std::memcpy(buf.data(), &node, sizeof(node));
-    return writePage(pageId, buf.data());
+    if (!writePage(pageId, buf.data())) return false;
+    cacheSearchNode(pageId, node);
+    return true;
+}
+
+void BPlusTree::SearchNode::build(const InternalNode &node) {
+    numKeys = node.hdr.numKeys;
+    std::memcpy(children, node.children, sizeof(uint32_t) * (numKeys + 1));
+    fillEytzinger(keys, rank, node.keys, numKeys, 0, 1);
+}
+
+uint32_t BPlusTree::SearchNode::childFor(int32_t key) const {
+    // Same result as the linear scan in findLeafPage: the index of the
+    // first key greater than 'key', or numKeys if there is none.
+    uint32_t k = 1;
+    while (k <= numKeys) {
+        // 16 keys per cache line: fetch the line holding our descendants
+        // four levels down while the next comparisons run
+        if (16 * k <= numKeys) __builtin_prefetch(&keys[16 * k]);
+        k = 2 * k + (keys[k] <= key ? 1u : 0u);
+    }
+    k >>= __builtin_ffs(~k);
+    return children[k == 0 ? numKeys : rank[k]];
+}
+
+void BPlusTree::cacheSearchNode(uint32_t pageId, const InternalNode &node) {
+    if (m_cache.capacity() == 0) return;
+    auto it = m_searchNodes.find(pageId);
+    if (it == m_searchNodes.end()) {
+        if (m_searchNodes.size() >= m_cache.capacity()) {
+            m_searchNodes.erase(m_searchNodes.begin());
+        }
+        it = m_searchNodes.emplace(pageId, std::unique_ptr<SearchNode>(new SearchNode())).first;
+    }
+    it->second->build(node);
 }
 
 bool BPlusTree::writeLeaf(uint32_t pageId, const LeafNode &node) {
@@ -157,9 +789,21 @@ bool BPlusTree::writeLeaf(uint32_t pageId, const LeafNode &node) {
 
 uint32_t BPlusTree::findLeafPage(int32_t key, std::vector<uint32_t> *path) {
     uint32_t page = m_header.rootPage;
-    if (path) path->clear();
+    if (path) {
+        path->clear();
+    } else if (m_radixEnabled) {
+        // skip the levels above the radix level; callers needing the full
+        // root-to-leaf path (inserts) still descend from the root
+        uint32_t subtree = INVALID_PAGE;
+        if (m_radix.floor(key, subtree)) page = subtree;
+    }
     while (true) {
         if (path) path->push_back(page);
+        auto cached = m_searchNodes.find(page);
+        if (cached != m_searchNodes.end()) {
+            page = cached->second->childFor(key);
+            continue;
+        }
         std::array<uint8_t, PAGE_SIZE> buf{};
         if (!readPage(page, buf.data())) return INVALID_PAGE;
 
@@ -174,6 +818,7 @@ uint32_t BPlusTree::findLeafPage(int32_t key, std::vector<uint32_t> *path) {
             while (i < inode.hdr.numKeys && key >= inode.keys[i]) {
                 ++i;
             }
+            cacheSearchNode(page, inode);
             page = inode.children[i];
         }
     }
@@ -197,7 +842,11 @@ bool BPlusTree::searchInLeaf(const LeafNode &leaf, int32_t key, uint32_t &index)
 }
 
 bool BPlusTree::writeData(int32_t key, const uint8_t data[VALUE_SIZE]) {
-    if (!isOk()) return false;
+    if (!isWritable() || changeLogBroken()) return false;
+    // secondary indexes need the value being replaced
+    std::array<uint8_t, VALUE_SIZE> oldValue{};
+    bool replaced = !m_indexes.empty() && readData(key, oldValue.data());
+    m_recordCache.erase(static_cast<uint32_t>(key));
     std::vector<uint32_t> path;
     uint32_t leafPage = findLeafPage(key, &path);
     if (leafPage == INVALID_PAGE) return false;
@@ -211,6 +860,20 @@ bool BPlusTree::writeData(int32_t key, const uint8_t data[VALUE_SIZE]) {
         // need to insert into parent
         if (!insertInParent(path, leafPage, promotedKey, newRightPage)) return false;
     }
+    if (zonesEnabled() || hashesEnabled()) {
+        // a split may have moved the key; find its current path
+        if (newRightPage != INVALID_PAGE) findLeafPage(key, &path);
+        if (zonesEnabled() && !widenZones(path, data)) return false;
+        if (!refreshHashes(path)) return false;
+    }
+    if (!updateIndexes(key, replaced ? oldValue.data() : nullptr, data)) return false;
+    ++m_histogramMods;
+    if (m_changeFd >= 0) {
+        WriteBatch::Op op{key, false, {}};
+        std::memcpy(op.value.data(), data, VALUE_SIZE);
+        const WriteBatch::Op *logged = &op;
+        return logChanges(&logged, 1);
+    }
     return true;
 }
 
@@ -295,6 +958,10 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
                                uint32_t leftPage,
                                int32_t key,
                                uint32_t rightPage) {
+    // 'path' runs from the root to leftPage, so leftPage is this many levels above the leaves
+    uint32_t level = m_height - static_cast<uint32_t>(path.size());
+    noteSplit(level, key, rightPage);
+
     // Case 1: tree was a single leaf and it just split
     if (path.size() == 1 && path[0] == m_header.rootPage) {
         InternalNode root{};
@@ -303,11 +970,15 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
         root.keys[0] = key;
         root.children[0] = leftPage;
         root.children[1] = rightPage;
+        if (!setChildZones(root, 0, leftPage) || !setChildZones(root, 1, rightPage) ||
+            !setChildHash(root, 0, leftPage) || !setChildHash(root, 1, rightPage)) {
+            return false;
+        }
 
         uint32_t newRootPage = allocatePage();
         if (newRootPage == INVALID_PAGE) return false;
         if (!writeInternal(newRootPage, root)) return false;
-        m_header.rootPage = newRootPage;
+        setRoot(newRootPage);
         return flushHeader();
     }
 
@@ -331,9 +1002,20 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
         }
         for (uint32_t i = parent.hdr.numKeys + 1; i > idxChild + 1; --i) {
             parent.children[i] = parent.children[i - 1];
+            for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) {
+                parent.zones[f][i] = parent.zones[f][i - 1];
+            }
+            parent.hashes[i] = parent.hashes[i - 1];
         }
         parent.keys[idxChild] = key;
         parent.children[idxChild + 1] = rightPage;
+        // leftPage keeps its old zone entry: a superset of what it now holds
+        if (!setChildZones(parent, idxChild + 1, rightPage)) return false;
+        // but hashes must be exact on both sides
+        if (!setChildHash(parent, idxChild, leftPage) ||
+            !setChildHash(parent, idxChild + 1, rightPage)) {
+            return false;
+        }
         ++parent.hdr.numKeys;
         return writeInternal(parentPage, parent);
     }
@@ -345,12 +1027,16 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
 
     int32_t tmpKeys[INTERNAL_MAX_KEYS + 1];
     uint32_t tmpChildren[INTERNAL_MAX_KEYS + 2];
+    ZoneRange tmpZones[INTERNAL_MAX_KEYS + 2][ZONE_MAX_FIELDS];
+    uint32_t tmpHashes[INTERNAL_MAX_KEYS + 2];
 
     for (uint32_t i = 0; i < parent.hdr.numKeys; ++i) {
         tmpKeys[i] = parent.keys[i];
     }
     for (uint32_t i = 0; i <= parent.hdr.numKeys; ++i) {
         tmpChildren[i] = parent.children[i];
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) tmpZones[i][f] = parent.zones[f][i];
+        tmpHashes[i] = parent.hashes[i];
     }
 
     // insert the new key/child into temporary arrays
@@ -359,9 +1045,16 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
     }
     for (uint32_t i = parent.hdr.numKeys + 1; i > idxChild + 1; --i) {
         tmpChildren[i] = tmpChildren[i - 1];
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) tmpZones[i][f] = tmpZones[i - 1][f];
+        tmpHashes[i] = tmpHashes[i - 1];
     }
     tmpKeys[idxChild] = key;
     tmpChildren[idxChild + 1] = rightPage;
+    if (zonesEnabled() && !nodeZones(rightPage, tmpZones[idxChild + 1])) return false;
+    if (hashesEnabled() && (!nodeHash(leftPage, tmpHashes[idxChild]) ||
+                            !nodeHash(rightPage, tmpHashes[idxChild + 1]))) {
+        return false;
+    }
 
     uint32_t total = parent.hdr.numKeys + 1; // total keys in temp
     uint32_t mid = total / 2;
@@ -371,17 +1064,23 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
     parent.hdr.numKeys = mid;
     for (uint32_t i = 0; i < mid; ++i) {
         parent.keys[i] = tmpKeys[i];
+    }
+    for (uint32_t i = 0; i <= mid; ++i) {
         parent.children[i] = tmpChildren[i];
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) parent.zones[f][i] = tmpZones[i][f];
+        parent.hashes[i] = tmpHashes[i];
     }
-    parent.children[mid] = tmpChildren[mid];
 
     // right (newParent) gets keys after midKey
     newParent.hdr.numKeys = total - mid - 1;
     for (uint32_t i = 0; i < newParent.hdr.numKeys; ++i) {
         newParent.keys[i] = tmpKeys[mid + 1 + i];
+    }
+    for (uint32_t i = 0; i <= newParent.hdr.numKeys; ++i) {
         newParent.children[i] = tmpChildren[mid + 1 + i];
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) newParent.zones[f][i] = tmpZones[mid + 1 + i][f];
+        newParent.hashes[i] = tmpHashes[mid + 1 + i];
     }
-    newParent.children[newParent.hdr.numKeys] = tmpChildren[total];
 
     uint32_t newPage = allocatePage();
     if (newPage == INVALID_PAGE) return false;
@@ -390,17 +1089,23 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
 
     // If parent was root, create a new root
     if (parentPage == m_header.rootPage) {
+        // the root split is not propagated through a recursive call, record it here
+        noteSplit(level + 1, midKey, newPage);
         InternalNode newRoot{};
         newRoot.hdr.type = static_cast<uint8_t>(NodeType::INTERNAL);
         newRoot.hdr.numKeys = 1;
         newRoot.keys[0] = midKey;
         newRoot.children[0] = parentPage;
         newRoot.children[1] = newPage;
+        if (!setChildZones(newRoot, 0, parentPage) || !setChildZones(newRoot, 1, newPage) ||
+            !setChildHash(newRoot, 0, parentPage) || !setChildHash(newRoot, 1, newPage)) {
+            return false;
+        }
 
         uint32_t rootPage = allocatePage();
         if (rootPage == INVALID_PAGE) return false;
         if (!writeInternal(rootPage, newRoot)) return false;
-        m_header.rootPage = rootPage;
+        setRoot(rootPage);
         return flushHeader();
     }
 
@@ -417,6 +1122,7 @@ bool BPlusTree::insertInParent(const std::vector<uint32_t> &path,
 
 bool BPlusTree::readData(int32_t key, uint8_t outData[VALUE_SIZE]) {
     if (!isOk()) return false;
+    if (m_recordCache.get(static_cast<uint32_t>(key), outData)) return true;
     uint32_t leafPage = findLeafPage(key, nullptr);
     if (leafPage == INVALID_PAGE) return false;
     LeafNode leaf{};
@@ -425,6 +1131,7 @@ bool BPlusTree::readData(int32_t key, uint8_t outData[VALUE_SIZE]) {
     bool found = searchInLeaf(leaf, key, idx);
     if (!found) return false;
     std::memcpy(outData, leaf.values[idx], VALUE_SIZE);
+    m_recordCache.put(static_cast<uint32_t>(key), outData);
     return true;
 }
 
@@ -457,12 +1164,294 @@ BPlusTree::readRangeData(int32_t lowerKey, int32_t upperKey, int &n) {
     return result;
 }
 
-bool BPlusTree::deleteFromLeaf(uint32_t leafPage, int32_t key) {
+void WriteBatch::put(int32_t key, const uint8_t data[VALUE_SIZE]) {
+    Op op{key, false, {}};
+    std::memcpy(op.value.data(), data, VALUE_SIZE);
+    ops.push_back(op);
+}
+
+void WriteBatch::remove(int32_t key) {
+    ops.push_back(Op{key, true, {}});
+}
+
+bool BPlusTree::writeBatch(const WriteBatch &batch) {
+    return writeBatchAt(batch, 0);
+}
+
+bool BPlusTree::writeBatchAt(const WriteBatch &batch, uint64_t changeSeq) {
+    if (!isWritable() || changeLogBroken()) return false;
+    if (batch.ops.empty()) return true;
+
+    // the last operation on each key, in key order
+    std::vector<const WriteBatch::Op *> sorted;
+    sorted.reserve(batch.ops.size());
+    for (const WriteBatch::Op &op : batch.ops) sorted.push_back(&op);
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const WriteBatch::Op *a, const WriteBatch::Op *b) { return a->key < b->key; });
+    std::vector<const WriteBatch::Op *> ops;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (i + 1 < sorted.size() && sorted[i + 1]->key == sorted[i]->key) continue;
+        ops.push_back(sorted[i]);
+        m_recordCache.erase(static_cast<uint32_t>(sorted[i]->key));
+    }
+
+    off_t end = lseek(m_fd, 0, SEEK_END);
+    if (end < 0) return false;
+    const FileHeader savedHeader = m_header;
+    const uint32_t savedHeight = m_height;
+    m_batchActive = true;
+    m_batchNextPage = static_cast<uint32_t>(end / PAGE_SIZE);
+    if (changeSeq != 0) {
+        // committed together with the changes it counts
+        m_header.changeSeq = changeSeq;
+        if (!flushHeader()) {
+            abortBatch(savedHeader, savedHeight);
+            return false;
+        }
+    }
+    std::vector<std::array<uint8_t, VALUE_SIZE>> oldValues(m_indexes.empty() ? 0 : ops.size());
+    std::vector<bool> hadOld(oldValues.size(), false);
+    if (!applyBatch(ops, oldValues, hadOld) || !commitBatch()) {
+        abortBatch(savedHeader, savedHeight);
+        return false;
+    }
+    m_histogramMods += ops.size();
+
+    // Secondary indexes follow the committed batch. If we crash before they
+    // are updated, the journal is still pending and its replay rebuilds them.
+    for (size_t i = 0; i < oldValues.size(); ++i) {
+        const uint8_t *newValue = ops[i]->remove ? nullptr : ops[i]->value.data();
+        if (!updateIndexes(ops[i]->key, hadOld[i] ? oldValues[i].data() : nullptr, newValue)) {
+            return false;
+        }
+    }
+    return changeSeq != 0 || logChanges(ops.data(), ops.size());
+}
+
+uint32_t BPlusTree::findLeafBounded(int32_t key, std::vector<uint32_t> &path,
+                                    int64_t &upperBound) {
+    path.clear();
+    upperBound = INT64_MAX;
+    uint32_t page = m_header.rootPage;
+    while (true) {
+        path.push_back(page);
+        InternalNode node{};
+        if (!readInternal(page, node)) return INVALID_PAGE;
+        if (node.hdr.type == static_cast<uint8_t>(NodeType::LEAF)) return page;
+        uint32_t i = static_cast<uint32_t>(
+            std::upper_bound(node.keys, node.keys + node.hdr.numKeys, key) - node.keys);
+        if (i < node.hdr.numKeys) upperBound = node.keys[i];
+        page = node.children[i];
+    }
+}
+
+bool BPlusTree::applyBatch(const std::vector<const WriteBatch::Op *> &ops,
+                           std::vector<std::array<uint8_t, VALUE_SIZE>> &oldValues,
+                           std::vector<bool> &hadOld) {
+    const bool wantOld = !oldValues.empty();
+    std::vector<uint32_t> path;
+    size_t i = 0;
+    while (i < ops.size()) {
+        // one descent, then every operation that falls into this leaf
+        int64_t upperBound = INT64_MAX;
+        uint32_t leafPage = findLeafBounded(ops[i]->key, path, upperBound);
+        if (leafPage == INVALID_PAGE) return false;
+        LeafNode leaf{};
+        if (!readLeaf(leafPage, leaf)) return false;
+
+        const size_t first = i;
+        bool dirty = false;
+        for (; i < ops.size() && ops[i]->key < upperBound; ++i) {
+            const WriteBatch::Op &op = *ops[i];
+            uint32_t idx = 0;
+            bool found = searchInLeaf(leaf, op.key, idx);
+            if (wantOld) {
+                hadOld[i] = found;
+                if (found) std::memcpy(oldValues[i].data(), leaf.values[idx], VALUE_SIZE);
+            }
+            if (op.remove) {
+                if (!found) continue;
+                for (uint32_t k = idx + 1; k < leaf.hdr.numKeys; ++k) {
+                    leaf.keys[k - 1] = leaf.keys[k];
+                    std::memcpy(leaf.values[k - 1], leaf.values[k], VALUE_SIZE);
+                }
+                --leaf.hdr.numKeys;
+            } else if (found) {
+                std::memcpy(leaf.values[idx], op.value.data(), VALUE_SIZE);
+            } else if (leaf.hdr.numKeys < LEAF_MAX_KEYS) {
+                for (uint32_t k = leaf.hdr.numKeys; k > idx; --k) {
+                    leaf.keys[k] = leaf.keys[k - 1];
+                    std::memcpy(leaf.values[k], leaf.values[k - 1], VALUE_SIZE);
+                }
+                leaf.keys[idx] = op.key;
+                std::memcpy(leaf.values[idx], op.value.data(), VALUE_SIZE);
+                ++leaf.hdr.numKeys;
+            } else {
+                break; // the leaf is full
+            }
+            dirty = true;
+        }
+        if (dirty && (!writeLeaf(leafPage, leaf) || !refreshHashes(path))) return false;
+        for (size_t k = first; zonesEnabled() && k < i; ++k) {
+            if (!ops[k]->remove && !widenZones(path, ops[k]->value.data())) return false;
+        }
+
+        if (i < ops.size() && ops[i]->key < upperBound) {
+            // split the full leaf the way writeData does, then descend again
+            const WriteBatch::Op &op = *ops[i];
+            int32_t promotedKey = 0;
+            uint32_t newRightPage = INVALID_PAGE;
+            if (!insertInLeaf(leafPage, op.key, op.value.data(), promotedKey, newRightPage)) {
+                return false;
+            }
+            if (newRightPage != INVALID_PAGE &&
+                !insertInParent(path, leafPage, promotedKey, newRightPage)) {
+                return false;
+            }
+            if (zonesEnabled() || hashesEnabled()) {
+                findLeafPage(op.key, &path);
+                if (zonesEnabled() && !widenZones(path, op.value.data())) return false;
+                if (!refreshHashes(path)) return false;
+            }
+            ++i;
+        }
+    }
+    return true;
+}
+
+bool BPlusTree::commitBatch() {
+    // one journal record holding the final image of every page the batch touched
+    std::vector<uint8_t> rec(sizeof(JournalRecord) + m_batchPages.size() * JOURNAL_ENTRY_SIZE);
+    uint8_t *entry = rec.data() + sizeof(JournalRecord);
+    for (const auto &p : m_batchPages) {
+        std::memcpy(entry, &p.first, sizeof(uint32_t));
+        std::memcpy(entry + sizeof(uint32_t), p.second.data(), PAGE_SIZE);
+        entry += JOURNAL_ENTRY_SIZE;
+    }
+    JournalRecord hdr{JOURNAL_MAGIC, static_cast<uint32_t>(m_batchPages.size()),
+                      journalChecksum(rec.data() + sizeof(JournalRecord),
+                                      rec.size() - sizeof(JournalRecord))};
+    std::memcpy(rec.data(), &hdr, sizeof(hdr));
+
+    if (m_walFd < 0) {
+        m_walFd = ::open(walFileName().c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_walFd < 0) {
+            perror("open");
+            return false;
+        }
+    }
+    if (::pwrite(m_walFd, rec.data(), rec.size(), static_cast<off_t>(m_walSize)) !=
+            static_cast<ssize_t>(rec.size()) ||
+        ::fdatasync(m_walFd) != 0) {
+        return false;
+    }
+    m_walSize += rec.size();
+
+    // Committed. Write the pages in place; they need not be durable until
+    // the journal is checkpointed.
+    m_batchActive = false;
+    for (const auto &p : m_batchPages) {
+        preserveForBackup(p.first);
+        if (::pwrite(m_fd, p.second.data(), PAGE_SIZE, static_cast<off_t>(pageOffset(p.first))) !=
+            static_cast<ssize_t>(PAGE_SIZE)) {
+            // The file no longer matches the cache: stop using the tree.
+            // The journal is kept, and replaying it at the next open
+            // completes the batch.
+            m_ok = false;
+            m_batchPages.clear();
+            return false;
+        }
+    }
+    m_batchPages.clear();
+    if (m_walSize >= JOURNAL_CHECKPOINT_BYTES) checkpointJournal();
+    return true;
+}
+
+void BPlusTree::abortBatch(const FileHeader &savedHeader, uint32_t savedHeight) {
+    m_batchActive = false;
+    for (const auto &p : m_batchPages) {
+        m_cache.erase(p.first);
+        m_searchNodes.erase(p.first);
+    }
+    m_batchPages.clear();
+    m_header = savedHeader;
+    m_height = savedHeight;
+    // splits made by the batch may have reached the radix index
+    if (m_radixEnabled) enableRadixIndex(m_radixLevel);
+}
+
+bool BPlusTree::checkpointJournal() {
+    if (m_walSize == 0) return true;
+    if (::fsync(m_fd) != 0 || ::ftruncate(m_walFd, 0) != 0) return false;
+    m_walSize = 0;
+    return true;
+}
+
+bool BPlusTree::recoverJournal(bool &replayed) {
+    replayed = false;
+    if (!fileExists(walFileName())) return true;
+    m_walFd = ::open(walFileName().c_str(), O_RDWR);
+    if (m_walFd < 0) {
+        perror("open");
+        return false;
+    }
+    off_t size = lseek(m_walFd, 0, SEEK_END);
+    if (size <= 0) return size == 0;
+
+    // Replay complete records in order. A torn or corrupt record was never
+    // committed, and nothing after it was either.
+    uint64_t off = 0;
+    std::vector<uint8_t> entries;
+    while (off + sizeof(JournalRecord) <= static_cast<uint64_t>(size)) {
+        JournalRecord rec{};
+        if (::pread(m_walFd, &rec, sizeof(rec), static_cast<off_t>(off)) !=
+                static_cast<ssize_t>(sizeof(rec))) {
+            break;
+        }
+        if (rec.magic == JOURNAL_TRUNCATE_MAGIC) {
+            // a restored incremental of a source that shrank
+            if (rec.pageCount == 0 ||
+                journalChecksum(reinterpret_cast<const uint8_t *>(&rec.pageCount),
+                                sizeof(rec.pageCount)) != rec.checksum) {
+                break;
+            }
+            if (::ftruncate(m_fd, static_cast<off_t>(pageOffset(rec.pageCount))) != 0) return false;
+            off += sizeof(rec);
+            replayed = true;
+            continue;
+        }
+        if (rec.magic != JOURNAL_MAGIC ||
+            rec.pageCount > (static_cast<uint64_t>(size) - off - sizeof(rec)) / JOURNAL_ENTRY_SIZE) {
+            break;
+        }
+        entries.resize(static_cast<size_t>(rec.pageCount) * JOURNAL_ENTRY_SIZE);
+        if (::pread(m_walFd, entries.data(), entries.size(), static_cast<off_t>(off + sizeof(rec))) !=
+                static_cast<ssize_t>(entries.size()) ||
+            journalChecksum(entries.data(), entries.size()) != rec.checksum) {
+            break;
+        }
+        for (uint32_t i = 0; i < rec.pageCount; ++i) {
+            const uint8_t *e = entries.data() + static_cast<size_t>(i) * JOURNAL_ENTRY_SIZE;
+            uint32_t pageId = 0;
+            std::memcpy(&pageId, e, sizeof(pageId));
+            if (::pwrite(m_fd, e + sizeof(uint32_t), PAGE_SIZE, static_cast<off_t>(pageOffset(pageId))) !=
+                static_cast<ssize_t>(PAGE_SIZE)) {
+                return false;
+            }
+        }
+        off += sizeof(rec) + entries.size();
+        replayed = true;
+    }
+    return ::fsync(m_fd) == 0 && ::ftruncate(m_walFd, 0) == 0;
+}
+
+bool BPlusTree::deleteFromLeaf(uint32_t leafPage, int32_t key, uint8_t *oldValue) {
     LeafNode leaf{};
     if (!readLeaf(leafPage, leaf)) return false;
     uint32_t idx = 0;
     bool found = searchInLeaf(leaf, key, idx);
     if (!found) return false;
+    if (oldValue) std::memcpy(oldValue, leaf.values[idx], VALUE_SIZE);
 
     for (uint32_t i = idx + 1; i < leaf.hdr.numKeys; ++i) {
         leaf.keys[i - 1] = leaf.keys[i];
@@ -473,11 +1462,2242 @@ bool BPlusTree::deleteFromLeaf(uint32_t leafPage, int32_t key) {
 }
 
 bool BPlusTree::deleteData(int32_t key) {
-    if (!isOk()) return false;
-    uint32_t leafPage = findLeafPage(key, nullptr);
+    if (!isWritable() || changeLogBroken()) return false;
+    m_recordCache.erase(static_cast<uint32_t>(key));
+    std::vector<uint32_t> path;
+    uint32_t leafPage = findLeafPage(key, hashesEnabled() ? &path : nullptr);
     if (leafPage == INVALID_PAGE) return false;
     // Simplified: delete from leaf only, no rebalancing
-    return deleteFromLeaf(leafPage, key);
+    std::array<uint8_t, VALUE_SIZE> oldValue{};
+    if (!deleteFromLeaf(leafPage, key, oldValue.data())) return false;
+    if (!refreshHashes(path)) return false;
+    if (!updateIndexes(key, oldValue.data(), nullptr)) return false;
+    ++m_histogramMods;
+    if (m_changeFd >= 0) {
+        WriteBatch::Op op{key, true, {}};
+        const WriteBatch::Op *logged = &op;
+        return logChanges(&logged, 1);
+    }
+    return true;
+}
+
+
+
+bool BPlusTree::freeze(const std::string &targetFile) {
+    if (!isOk()) return false;
+    int out = ::open(targetFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open");
+        return false;
+    }
+    bool ok = writeFrozen(out) && ::fsync(out) == 0;
+    ::close(out);
+    if (!ok) ::unlink(targetFile.c_str());
+    return ok;
+}
+
+bool BPlusTree::clone(const std::string &targetFile, unsigned threads) {
+    if (!isOk() || m_batchActive) return false;
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    // everything the copy needs must be in the files themselves
+    if (!m_readOnly && (!flushHeader() || !checkpointJournal())) return false;
+
+    std::vector<std::pair<std::string, std::string>> files{{m_filename, targetFile}};
+    for (uint32_t i = 0; i < m_header.indexFieldCount; ++i) {
+        std::string name = indexFileName(m_header.indexFields[i]);
+        files.emplace_back(name, targetFile + name.substr(m_filename.size()));
+    }
+    bool ok = true;
+    size_t done = 0;
+    for (; ok && done < files.size(); ++done) {
+        int in = ::open(files[done].first.c_str(), O_RDONLY);
+        int out = ::open(files[done].second.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = in >= 0 && out >= 0 && copyFile(in, out, threads);
+        if (ok && done == 0) {
+            // present the copy as cleanly closed
+            FileHeader hdr = m_header;
+            // the copy does not append to this tree's change log
+            hdr.flags &= ~(FILE_FLAG_OPEN | FILE_FLAG_CHANGE_LOG | FILE_FLAG_CHANGE_LOG_BROKEN);
+            std::array<uint8_t, PAGE_SIZE> page0{};
+            std::memcpy(page0.data(), &hdr, sizeof(hdr));
+            ok = ::pwrite(out, page0.data(), PAGE_SIZE, 0) == static_cast<ssize_t>(PAGE_SIZE);
+        }
+        ok = ok && ::fsync(out) == 0;
+        if (!ok) perror("clone");
+        if (in >= 0) ::close(in);
+        if (out >= 0) ::close(out);
+    }
+    if (!ok) {
+        for (size_t i = 0; i < done; ++i) ::unlink(files[i].second.c_str());
+    }
+    return ok;
+}
+
+bool BPlusTree::split(int32_t key, const std::string &leftFile, const std::string &rightFile) {
+    if (!isOk() || m_batchActive || leftFile == rightFile) return false;
+    SplitPart left;
+    SplitPart right;
+    bool ok = splitSide(m_header.rootPage, m_height - 1, key, false, left) &&
+              splitSide(m_header.rootPage, m_height - 1, key, true, right) &&
+              writeSplit(leftFile, std::move(left)) && writeSplit(rightFile, std::move(right));
+
+    // the files are written without indexes; build them through the API
+    for (const std::string &file : {leftFile, rightFile}) {
+        if (!ok || m_header.indexFieldCount == 0) break;
+        BPlusTree shard(file);
+        for (uint32_t i = 0; ok && i < m_header.indexFieldCount; ++i) {
+            ok = shard.createIndex(m_header.indexFields[i]);
+        }
+    }
+    if (!ok) {
+        for (const std::string &file : {leftFile, rightFile}) {
+            ::unlink(file.c_str());
+            for (uint32_t i = 0; i < m_header.indexFieldCount; ++i) {
+                std::string name = indexFileName(m_header.indexFields[i]);
+                ::unlink((file + name.substr(m_filename.size())).c_str());
+            }
+        }
+    }
+    return ok;
 }
 
+bool BPlusTree::splitSide(uint32_t pageId, uint32_t height, int32_t key, bool right, SplitPart &out) {
+    out = SplitPart();
+    if (height == 0) {
+        auto n = std::make_shared<SplitNode>();
+        LeafNode &leaf = n->leaf;
+        if (!readLeaf(pageId, leaf)) return false;
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < leaf.hdr.numKeys; ++i) {
+            if ((leaf.keys[i] >= key) != right) continue;
+            leaf.keys[kept] = leaf.keys[i];
+            std::memmove(leaf.values[kept], leaf.values[i], VALUE_SIZE);
+            ++kept;
+        }
+        leaf.hdr.numKeys = kept;
+        if (kept > 0) out.refs.push_back(splitRef(0, n));
+        return true;
+    }
+
+    std::unique_ptr<InternalNode> node(new InternalNode());
+    if (!readInternal(pageId, *node)) return false;
+    const uint32_t n = node->hdr.numKeys;
+    const uint32_t idx = static_cast<uint32_t>(
+        std::upper_bound(node->keys, node->keys + n, key) - node->keys);
+    SplitPart below;
+    if (!splitSide(node->children[idx], height - 1, key, right, below)) return false;
+
+    // children wholly on this side, kept as they are
+    SplitPart kept;
+    const uint32_t first = right ? idx + 1 : 0;
+    const uint32_t last = right ? n + 1 : idx;
+    for (uint32_t i = first; i < last; ++i) {
+        if (i > first) kept.seps.push_back(node->keys[i - 1]);
+        SplitRef r;
+        r.height = height - 1;
+        r.page = node->children[i];
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) r.zones[f] = node->zones[f][i];
+        r.hash = node->hashes[i];
+        kept.refs.push_back(r);
+    }
+    if (kept.refs.empty() || below.refs.empty()) {
+        out = kept.refs.empty() ? std::move(below) : splitNodes(height, std::move(kept));
+        return true;
+    }
 
+    int32_t sep = right ? node->keys[idx] : node->keys[idx - 1];
+    if (below.refs[0].height + 1 < height) {
+        // too short to sit next to the kept children: it joins the edge of
+        // its neighbour, whose place it takes
+        SplitRef edge = right ? kept.refs.front() : kept.refs.back();
+        SplitPart joined;
+        if (!splitAttach(edge, below, sep, !right, joined)) return false;
+        below = std::move(joined);
+        if (right) {
+            kept.refs.erase(kept.refs.begin());
+        } else {
+            kept.refs.pop_back();
+        }
+        if (kept.refs.empty()) {
+            out = splitNodes(height, std::move(below));
+            return true;
+        }
+        sep = right ? kept.seps.front() : kept.seps.back();
+        if (right) {
+            kept.seps.erase(kept.seps.begin());
+        } else {
+            kept.seps.pop_back();
+        }
+    }
+    SplitPart all = right ? splitJoin(std::move(below), sep, std::move(kept))
+                          : splitJoin(std::move(kept), sep, std::move(below));
+    out = splitNodes(height, std::move(all));
+    return true;
+}
+
+bool BPlusTree::splitAttach(const SplitRef &target, const SplitPart &part, int32_t sep, bool atEnd,
+                            SplitPart &out) {
+    std::unique_ptr<InternalNode> node(new InternalNode());
+    if (!readInternal(target.page, *node)) return false;
+    SplitPart children;
+    for (uint32_t i = 0; i <= node->hdr.numKeys; ++i) {
+        if (i > 0) children.seps.push_back(node->keys[i - 1]);
+        SplitRef r;
+        r.height = target.height - 1;
+        r.page = node->children[i];
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) r.zones[f] = node->zones[f][i];
+        r.hash = node->hashes[i];
+        children.refs.push_back(r);
+    }
+
+    if (part.refs[0].height + 1 < target.height) {
+        // further down the edge; the result replaces the edge child
+        SplitRef edge = atEnd ? children.refs.back() : children.refs.front();
+        SplitPart joined;
+        if (!splitAttach(edge, part, sep, atEnd, joined)) return false;
+        if (atEnd) {
+            children.refs.pop_back();
+            children.refs.insert(children.refs.end(), joined.refs.begin(), joined.refs.end());
+            children.seps.insert(children.seps.end(), joined.seps.begin(), joined.seps.end());
+        } else {
+            children.refs.erase(children.refs.begin());
+            children.refs.insert(children.refs.begin(), joined.refs.begin(), joined.refs.end());
+            children.seps.insert(children.seps.begin(), joined.seps.begin(), joined.seps.end());
+        }
+    } else {
+        children = atEnd ? splitJoin(std::move(children), sep, part)
+                         : splitJoin(part, sep, std::move(children));
+    }
+    out = splitNodes(target.height, std::move(children));
+    return true;
+}
+
+BPlusTree::SplitPart BPlusTree::splitJoin(SplitPart left, int32_t sep, SplitPart right) {
+    left.seps.push_back(sep);
+    left.seps.insert(left.seps.end(), right.seps.begin(), right.seps.end());
+    left.refs.insert(left.refs.end(), right.refs.begin(), right.refs.end());
+    return left;
+}
+
+BPlusTree::SplitPart BPlusTree::splitNodes(uint32_t height, SplitPart part) const {
+    if (part.refs.size() <= 1) return part;
+    // as in writePacked: the fewest nodes that hold them, evenly filled
+    const size_t fanout = INTERNAL_MAX_KEYS + 1;
+    const size_t total = part.refs.size();
+    const size_t nodes = (total + fanout - 1) / fanout;
+    SplitPart out;
+    size_t pos = 0;
+    for (size_t i = 0; i < nodes; ++i) {
+        size_t count = total / nodes + (i < total % nodes ? 1 : 0);
+        auto n = std::make_shared<SplitNode>();
+        n->children.assign(part.refs.begin() + pos, part.refs.begin() + pos + count);
+        n->keys.assign(part.seps.begin() + pos, part.seps.begin() + pos + count - 1);
+        if (i > 0) out.seps.push_back(part.seps[pos - 1]);
+        out.refs.push_back(splitRef(height, n));
+        pos += count;
+    }
+    return out;
+}
+
+BPlusTree::SplitRef BPlusTree::splitRef(uint32_t height, const std::shared_ptr<SplitNode> &node) const {
+    SplitRef r;
+    r.height = height;
+    r.node = node;
+    if (height == 0) {
+        leafZones(node->leaf, r.zones);
+        r.hash = leafHash(node->leaf);
+    } else {
+        std::unique_ptr<InternalNode> image(new InternalNode());
+        splitFill(*node, *image);
+        internalZones(*image, r.zones);
+        r.hash = internalHash(*image);
+    }
+    return r;
+}
+
+void BPlusTree::splitFill(const SplitNode &n, InternalNode &node) const {
+    std::memset(&node, 0, sizeof(node));
+    node.hdr.type = static_cast<uint8_t>(NodeType::INTERNAL);
+    node.hdr.numKeys = static_cast<uint32_t>(n.keys.size());
+    std::copy(n.keys.begin(), n.keys.end(), node.keys);
+    for (size_t c = 0; c < n.children.size(); ++c) {
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) node.zones[f][c] = n.children[c].zones[f];
+        node.hashes[c] = n.children[c].hash;
+    }
+}
+
+bool BPlusTree::writeSplit(const std::string &file, SplitPart part) {
+    if (part.refs.empty()) {
+        // nothing on this side: an empty root leaf
+        auto n = std::make_shared<SplitNode>();
+        n->leaf.hdr.type = static_cast<uint8_t>(NodeType::LEAF);
+        n->leaf.nextLeaf = INVALID_PAGE;
+        part.refs.push_back(splitRef(0, n));
+    }
+    while (part.refs.size() > 1) part = splitNodes(part.refs[0].height + 1, std::move(part));
+
+    int out = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open");
+        return false;
+    }
+    uint64_t lsn = m_nextLsn;
+    auto emit = [&](uint32_t pageId, const void *node, size_t size) {
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        std::memcpy(buf.data(), node, size);
+        if (pageId != 0) {
+            std::memcpy(buf.data() + PAGE_LSN_OFFSET, &lsn, sizeof(lsn));
+            ++lsn;
+            if (checksumsEnabled()) stampChecksum(buf.data());
+        }
+        return ::pwrite(out, buf.data(), PAGE_SIZE, static_cast<off_t>(pageOffset(pageId))) ==
+               static_cast<ssize_t>(PAGE_SIZE);
+    };
+
+    // Depth first in key order, children before their parent. A leaf is
+    // written once the next one has a page id to link to.
+    uint32_t nextPage = 1;
+    std::unique_ptr<LeafNode> pending(new LeafNode());
+    uint32_t pendingPage = INVALID_PAGE;
+    std::function<bool(const SplitRef &, uint32_t &)> write = [&](const SplitRef &ref, uint32_t &page) {
+        if (ref.height == 0) {
+            page = nextPage++;
+            if (pendingPage != INVALID_PAGE) {
+                pending->nextLeaf = page;
+                if (!emit(pendingPage, pending.get(), sizeof(LeafNode))) return false;
+            }
+            pendingPage = page;
+            if (ref.node) {
+                *pending = ref.node->leaf;
+                return true;
+            }
+            return readLeaf(ref.page, *pending);
+        }
+        std::unique_ptr<InternalNode> node(new InternalNode());
+        if (ref.node) {
+            splitFill(*ref.node, *node);
+            for (size_t c = 0; c < ref.node->children.size(); ++c) {
+                if (!write(ref.node->children[c], node->children[c])) return false;
+            }
+        } else {
+            if (!readInternal(ref.page, *node)) return false;
+            for (uint32_t c = 0; c <= node->hdr.numKeys; ++c) {
+                SplitRef child;
+                child.height = ref.height - 1;
+                child.page = node->children[c];
+                if (!write(child, node->children[c])) return false;
+            }
+        }
+        page = nextPage++;
+        return emit(page, node.get(), sizeof(InternalNode));
+    };
+
+    uint32_t root = INVALID_PAGE;
+    bool ok = write(part.refs[0], root);
+    if (ok) {
+        pending->nextLeaf = INVALID_PAGE;
+        ok = emit(pendingPage, pending.get(), sizeof(LeafNode));
+    }
+    if (ok) {
+        FileHeader hdr = m_header;
+        hdr.rootPage = root;
+        hdr.freeListHead = INVALID_PAGE;
+        // checksums stay on or off as in this tree
+        hdr.flags &= ~(FILE_FLAG_OPEN | FILE_FLAG_FROZEN | FILE_FLAG_CHANGE_LOG |
+                       FILE_FLAG_CHANGE_LOG_BROKEN);
+        hdr.indexFieldCount = 0;
+        hdr.lsnLimit = lsn + LSN_RESERVE_BLOCK;
+        ok = emit(0, &hdr, sizeof(hdr)) && ::fsync(out) == 0;
+    }
+    ::close(out);
+    if (!ok) ::unlink(file.c_str());
+    return ok;
+}
+
+bool BPlusTree::writeFrozen(int outFd) {
+    std::unique_ptr<LeafCursor> c(new LeafCursor());
+    bool valid = cursorSeek(*c, INT32_MIN);
+    auto next = [&](int32_t &key, uint8_t *value) {
+        if (!valid) return false;
+        key = c->leaf.keys[c->idx];
+        std::memcpy(value, c->leaf.values[c->idx], VALUE_SIZE);
+        valid = cursorNext(*c);
+        return true;
+    };
+    FileHeader hdr{};
+    hdr.magic = MAGIC;
+    hdr.pageSize = PAGE_SIZE;
+    hdr.freeListHead = INVALID_PAGE;
+    hdr.flags = FILE_FLAG_FROZEN | FILE_FLAG_CHECKSUMS | FILE_FLAG_HASHES;
+    hdr.zoneFieldCount = m_header.zoneFieldCount;
+    std::memcpy(hdr.zoneFields, m_header.zoneFields, sizeof(hdr.zoneFields));
+    return writePacked(outFd, next, hdr, false, 100) && !c->failed;
+}
+
+bool BPlusTree::writePacked(int outFd, const RecordSource &next, FileHeader hdr, bool stampLsns,
+                            uint32_t fillPercent) {
+    const uint32_t leafKeys = std::max<uint32_t>(1, LEAF_MAX_KEYS * fillPercent / 100);
+    const size_t fanout = std::max<size_t>(2, (INTERNAL_MAX_KEYS + 1) * fillPercent / 100);
+    auto emit = [&](uint32_t pageId, const void *node, size_t size) {
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        std::memcpy(buf.data(), node, size);
+        if (pageId != 0 && stampLsns) {
+            uint64_t lsn = m_nextLsn++;
+            std::memcpy(buf.data() + PAGE_LSN_OFFSET, &lsn, sizeof(lsn));
+        }
+        if (pageId != 0 && (hdr.flags & FILE_FLAG_CHECKSUMS)) stampChecksum(buf.data());
+        return ::pwrite(outFd, buf.data(), PAGE_SIZE, static_cast<off_t>(pageOffset(pageId))) ==
+               static_cast<ssize_t>(PAGE_SIZE);
+    };
+
+    // first key, page, zone map and hash of every node on the level being built
+    struct Entry {
+        int32_t firstKey;
+        uint32_t page;
+        ZoneRange zones[ZONE_MAX_FIELDS];
+        uint32_t hash;
+    };
+    std::vector<Entry> level;
+    uint32_t nextPage = 1;
+    auto emitLeaf = [&](LeafNode &leaf) {
+        Entry e{leaf.hdr.numKeys ? leaf.keys[0] : INT32_MIN, nextPage++, {}, leafHash(leaf)};
+        leafZones(leaf, e.zones);
+        level.push_back(e);
+        return emit(e.page, &leaf, sizeof(leaf));
+    };
+
+    // Leaves: the records in order, leafKeys to a page
+    LeafNode out{};
+    out.hdr.type = static_cast<uint8_t>(NodeType::LEAF);
+    int32_t key = 0;
+    std::array<uint8_t, VALUE_SIZE> value{};
+    while (next(key, value.data())) {
+        if (out.hdr.numKeys == leafKeys) {
+            out.nextLeaf = nextPage + 1;
+            if (!emitLeaf(out)) return false;
+            out.hdr.numKeys = 0;
+        }
+        out.keys[out.hdr.numKeys] = key;
+        std::memcpy(out.values[out.hdr.numKeys], value.data(), VALUE_SIZE);
+        ++out.hdr.numKeys;
+    }
+    out.nextLeaf = INVALID_PAGE;
+    if (!emitLeaf(out)) return false;
+
+    // Internal levels, bottom-up. Children are spread evenly over the
+    // fewest nodes that can hold them within the fill, so no node is left
+    // nearly empty.
+    while (level.size() > 1) {
+        size_t nodes = (level.size() + fanout - 1) / fanout;
+        std::vector<Entry> parents;
+        size_t pos = 0;
+        for (size_t n = 0; n < nodes; ++n) {
+            size_t count = level.size() / nodes + (n < level.size() % nodes ? 1 : 0);
+            InternalNode node{};
+            node.hdr.type = static_cast<uint8_t>(NodeType::INTERNAL);
+            node.hdr.numKeys = static_cast<uint32_t>(count - 1);
+            for (size_t c = 0; c < count; ++c) {
+                node.children[c] = level[pos + c].page;
+                if (c > 0) node.keys[c - 1] = level[pos + c].firstKey;
+                for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) {
+                    node.zones[f][c] = level[pos + c].zones[f];
+                }
+                node.hashes[c] = level[pos + c].hash;
+            }
+            Entry e{level[pos].firstKey, nextPage++, {}, internalHash(node)};
+            internalZones(node, e.zones);
+            if (!emit(e.page, &node, sizeof(node))) return false;
+            parents.push_back(e);
+            pos += count;
+        }
+        level.swap(parents);
+    }
+
+    hdr.rootPage = level[0].page;
+    if (stampLsns) hdr.lsnLimit = m_nextLsn + LSN_RESERVE_BLOCK;
+    return emit(0, &hdr, sizeof(hdr));
+}
+
+double BPlusTree::estimateMergeLeaves(const std::vector<std::pair<int32_t, uint32_t>> &leaves,
+                                     const std::vector<std::pair<int32_t, uint32_t>> &deltaLeaves,
+                                     const std::vector<uint32_t> &deltaCounts) {
+    auto lower = [](int64_t key, const std::pair<int32_t, uint32_t> &l) { return key < l.first; };
+    double total = 0;
+    for (size_t i = 0; i < deltaLeaves.size(); ++i) {
+        int64_t low = deltaLeaves[i].first;
+        int64_t high = i + 1 < deltaLeaves.size() ? deltaLeaves[i + 1].first : INT64_MAX;
+        // target leaves starting in (low, high), plus the one containing low
+        size_t first = std::upper_bound(leaves.begin(), leaves.end(), low, lower) - leaves.begin();
+        size_t last = std::upper_bound(leaves.begin(), leaves.end(), high - 1, lower) - leaves.begin();
+        // expected number of them hit by the leaf's records, spread evenly
+        double m = std::max<size_t>(last - first + 1, 1);
+        total += m * (1.0 - std::pow(1.0 - 1.0 / m, deltaCounts[i]));
+    }
+    return total;
+}
+
+bool BPlusTree::merge(BPlusTree &delta, MergeStrategy strategy) {
+    if (!isWritable() || changeLogBroken() || !delta.isOk() || &delta == this || m_batchActive ||
+        m_backupActive) {
+        return false;
+    }
+    if (strategy == MergeStrategy::AUTO) {
+        std::vector<std::pair<int32_t, uint32_t>> leaves;
+        std::vector<std::pair<int32_t, uint32_t>> deltaLeaves;
+        if (!collectLevel(0, leaves) || !delta.collectLevel(0, deltaLeaves)) return false;
+        std::vector<uint32_t> deltaCounts;
+        std::unique_ptr<LeafNode> leaf(new LeafNode());
+        for (const auto &l : deltaLeaves) {
+            if (!delta.readLeaf(l.second, *leaf)) return false;
+            deltaCounts.push_back(leaf->hdr.numKeys);
+        }
+        double touched = estimateMergeLeaves(leaves, deltaLeaves, deltaCounts);
+        strategy = touched * MERGE_REBUILD_RATIO > leaves.size() + deltaLeaves.size()
+                       ? MergeStrategy::REBUILD
+                       : MergeStrategy::IN_PLACE;
+    }
+    return strategy == MergeStrategy::REBUILD ? mergeRebuild(delta) : mergeInPlace(delta);
+}
+
+bool BPlusTree::mergeInPlace(BPlusTree &delta) {
+    std::unique_ptr<LeafCursor> c(new LeafCursor());
+    bool valid = delta.cursorSeek(*c, INT32_MIN);
+    WriteBatch batch;
+    while (valid) {
+        batch.put(c->leaf.keys[c->idx], c->leaf.values[c->idx]);
+        valid = delta.cursorNext(*c);
+        if (batch.ops.size() == MERGE_BATCH_RECORDS || !valid) {
+            if (!writeBatch(batch)) return false;
+            batch.clear();
+        }
+    }
+    return !c->failed;
+}
+
+bool BPlusTree::mergeRebuild(BPlusTree &delta) {
+    // Both leaf chains merged in key order; delta wins on equal keys
+    std::unique_ptr<LeafCursor> a(new LeafCursor());
+    std::unique_ptr<LeafCursor> b(new LeafCursor());
+    bool va = cursorSeek(*a, INT32_MIN);
+    bool vb = delta.cursorSeek(*b, INT32_MIN);
+    auto next = [&](int32_t &key, uint8_t *value) {
+        if (!va && !vb) return false;
+        int64_t ka = va ? a->leaf.keys[a->idx] : INT64_MAX;
+        int64_t kb = vb ? b->leaf.keys[b->idx] : INT64_MAX;
+        if (kb <= ka) {
+            key = b->leaf.keys[b->idx];
+            std::memcpy(value, b->leaf.values[b->idx], VALUE_SIZE);
+            if (ka == kb) va = cursorNext(*a);
+            vb = delta.cursorNext(*b);
+        } else {
+            key = a->leaf.keys[a->idx];
+            std::memcpy(value, a->leaf.values[a->idx], VALUE_SIZE);
+            va = cursorNext(*a);
+        }
+        return true;
+    };
+
+    const std::string tmpName = m_filename + ".merge";
+    int out = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open");
+        return false;
+    }
+    // same settings (checksums on or off), indexes and counters; the new
+    // file is written closed
+    FileHeader hdr = m_header;
+    hdr.freeListHead = INVALID_PAGE;
+    hdr.flags &= ~FILE_FLAG_OPEN;
+    bool ok = writePacked(out, next, hdr, true, MERGE_REBUILD_FILL_PERCENT) && !a->failed && !b->failed && ::fsync(out) == 0;
+    ::close(out);
+    if (!ok || !checkpointJournal()) {
+        ::unlink(tmpName.c_str());
+        return false;
+    }
+
+    // Swap the new file in and reload everything derived from the old one
+    stopWarmup();
+    if (::rename(tmpName.c_str(), m_filename.c_str()) != 0) {
+        perror("rename");
+        ::unlink(tmpName.c_str());
+        return false;
+    }
+    ::close(m_fd);
+    m_fd = ::open(m_filename.c_str(), O_RDWR);
+    m_cache.clear();
+    m_recordCache.clear();
+    m_searchNodes.clear();
+    m_histogram = Histogram();
+    m_histogramMods = 0;
+    m_ok = m_fd >= 0 && loadHeader() && computeHeight();
+    if (m_ok && m_radixEnabled) m_ok = enableRadixIndex(m_radixLevel);
+    for (uint32_t i = 0; m_ok && i < m_indexes.size(); ++i) m_ok = buildIndex(i);
+    m_ok = m_ok && setOpenFlag(true);
+
+    // replicas receive delta as ordinary writes
+    if (m_ok && m_changeFd >= 0) {
+        std::unique_ptr<LeafCursor> c(new LeafCursor());
+        bool valid = delta.cursorSeek(*c, INT32_MIN);
+        std::vector<WriteBatch::Op> ops;
+        std::vector<const WriteBatch::Op *> logged;
+        while (m_ok && valid) {
+            ops.push_back(WriteBatch::Op{c->leaf.keys[c->idx], false, {}});
+            std::memcpy(ops.back().value.data(), c->leaf.values[c->idx], VALUE_SIZE);
+            valid = delta.cursorNext(*c);
+            if (ops.size() == MERGE_BATCH_RECORDS || !valid) {
+                logged.clear();
+                for (const WriteBatch::Op &op : ops) logged.push_back(&op);
+                m_ok = logChanges(logged.data(), logged.size());
+                ops.clear();
+            }
+        }
+    }
+    return m_ok;
+}
+
+bool BPlusTree::buildHistogram() {
+    m_histogram = Histogram();
+
+    // Every leaf with its lower bound, read from the internal nodes
+    std::vector<std::pair<int32_t, uint32_t>> leaves;
+    if (!collectLevel(0, leaves) || leaves.empty()) return false;
+
+    // Average leaf fill from an evenly spaced sample that always includes
+    // the first and last leaf, which also give the smallest and largest key.
+    // An empty end leaf (deletes don't rebalance) falls back to separators.
+    int64_t minKey = leaves.size() > 1 ? leaves[1].first : leaves[0].first;
+    int64_t maxKey = leaves.back().first;
+    size_t step = std::max<size_t>(1, leaves.size() / HISTOGRAM_SAMPLE_LEAVES);
+    double sampled = 0;
+    size_t samples = 0;
+    for (size_t i = 0;; i += step) {
+        bool last = i + step >= leaves.size();
+        size_t idx = last ? leaves.size() - 1 : i;
+        LeafNode leaf{};
+        if (!readLeaf(leaves[idx].second, leaf)) return false;
+        sampled += leaf.hdr.numKeys;
+        ++samples;
+        if (leaf.hdr.numKeys > 0) {
+            if (idx == 0) minKey = leaf.keys[0];
+            if (last) maxKey = leaf.keys[leaf.hdr.numKeys - 1];
+        }
+        if (last) break;
+    }
+    double fill = sampled / static_cast<double>(samples);
+
+    // Group consecutive leaves into equally sized buckets: all leaves hold
+    // about 'fill' keys, so each bucket holds about the same number of keys
+    size_t buckets = std::min(HISTOGRAM_BUCKETS, leaves.size());
+    size_t pos = 0;
+    for (size_t b = 0; b < buckets; ++b) {
+        size_t count = leaves.size() / buckets + (b < leaves.size() % buckets ? 1 : 0);
+        m_histogram.bounds.push_back(b == 0 ? minKey : leaves[pos].first);
+        m_histogram.counts.push_back(fill * static_cast<double>(count));
+        pos += count;
+    }
+    m_histogram.bounds.push_back(maxKey + 1);
+    m_histogram.total = fill * static_cast<double>(leaves.size());
+    m_histogram.valid = true;
+    m_histogramMods = 0;
+    return true;
+}
+
+uint64_t BPlusTree::estimateRange(int32_t lowerKey, int32_t upperKey) {
+    if (!isOk() || lowerKey > upperKey) return 0;
+    uint64_t staleAfter = std::max<uint64_t>(HISTOGRAM_MIN_STALE,
+                                             static_cast<uint64_t>(m_histogram.total / 10));
+    if (!m_histogram.valid || m_histogramMods > staleAfter) {
+        if (!buildHistogram()) return 0;
+    }
+
+    // Keys are assumed uniform within a bucket
+    const int64_t lo = lowerKey;
+    const int64_t hi = static_cast<int64_t>(upperKey) + 1;
+    double estimate = 0;
+    for (size_t b = 0; b < m_histogram.counts.size(); ++b) {
+        int64_t bLo = m_histogram.bounds[b];
+        int64_t bHi = m_histogram.bounds[b + 1];
+        if (bHi <= lo || bHi <= bLo) continue;
+        if (bLo >= hi) break;
+        int64_t overlap = std::min(hi, bHi) - std::max(lo, bLo);
+        estimate += m_histogram.counts[b] * static_cast<double>(overlap) /
+                    static_cast<double>(bHi - bLo);
+    }
+    return static_cast<uint64_t>(estimate + 0.5);
+}
+
+std::vector<Record> BPlusTree::sampleRecords(size_t k, uint64_t seed) {
+    std::vector<Record> out;
+    if (!isOk() || k == 0) return out;
+    out.reserve(k);
+    std::mt19937_64 rng(seed != 0 ? seed : std::random_device{}());
+    std::uniform_int_distribution<uint32_t> internalSlot(0, INTERNAL_MAX_KEYS);
+    std::uniform_int_distribution<uint32_t> leafSlot(0, LEAF_MAX_KEYS - 1);
+
+    // Accept/reject: a record is reached with probability
+    // 1/rootFanout * (1/(INTERNAL_MAX_KEYS+1))^(height-2) * 1/LEAF_MAX_KEYS,
+    // the same for every record. Every draw passes the root, so its fanout
+    // needs no rejection.
+    const uint64_t maxAttempts = SAMPLE_MAX_ATTEMPTS_PER_RECORD * k;
+    for (uint64_t attempt = 0; out.size() < k && attempt < maxAttempts; ++attempt) {
+        uint32_t page = m_header.rootPage;
+        bool atRoot = true;
+        while (page != INVALID_PAGE) {
+            std::array<uint8_t, PAGE_SIZE> buf{};
+            if (!readPage(page, buf.data())) return out;
+            NodeHeader nh{};
+            std::memcpy(&nh, buf.data(), sizeof(nh));
+            if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+                LeafNode leaf{};
+                std::memcpy(&leaf, buf.data(), sizeof(leaf));
+                if (atRoot) {
+                    if (leaf.hdr.numKeys == 0) return out;
+                    leafSlot = std::uniform_int_distribution<uint32_t>(0, leaf.hdr.numKeys - 1);
+                }
+                uint32_t slot = leafSlot(rng);
+                if (slot < leaf.hdr.numKeys) {
+                    Record r{};
+                    r.key = leaf.keys[slot];
+                    std::memcpy(r.value.data(), leaf.values[slot], VALUE_SIZE);
+                    out.push_back(r);
+                }
+                break;
+            }
+            InternalNode inode{};
+            std::memcpy(&inode, buf.data(), sizeof(inode));
+            uint32_t fanout = inode.hdr.numKeys + 1;
+            uint32_t slot = atRoot ? std::uniform_int_distribution<uint32_t>(0, fanout - 1)(rng)
+                                   : internalSlot(rng);
+            page = slot < fanout ? inode.children[slot] : INVALID_PAGE;
+            atRoot = false;
+        }
+    }
+    return out;
+}
+
+bool BPlusTree::aggregateRange(int32_t lowerKey, int32_t upperKey, const FieldDesc &field,
+                               AggregateResult &result) {
+    result = AggregateResult();
+    if (!isOk() || !fieldFits(field)) return false;
+    if (lowerKey > upperKey) return true;
+
+    uint32_t leafPage = findLeafPage(lowerKey, nullptr);
+    if (leafPage == INVALID_PAGE) return false;
+    bool first = true;
+    while (leafPage != INVALID_PAGE) {
+        LeafNode leaf{};
+        if (!readLeaf(leafPage, leaf)) return false;
+        // keys are sorted: the matching values are one contiguous run
+        uint32_t begin = 0;
+        if (first) searchInLeaf(leaf, lowerKey, begin);
+        uint32_t end = 0;
+        bool last = searchInLeaf(leaf, upperKey, end) || end < leaf.hdr.numKeys;
+        if (end < leaf.hdr.numKeys && leaf.keys[end] == upperKey) ++end;
+        if (end > begin) {
+            aggregateField(leaf.values[begin], end - begin, VALUE_SIZE, field, result);
+        }
+        if (last) break;
+        first = false;
+        leafPage = leaf.nextLeaf;
+    }
+    return true;
+}
+
+int32_t BPlusTree::zoneEncode(uint32_t f, const uint8_t value[VALUE_SIZE]) const {
+    const FieldDesc &field = m_header.zoneFields[f];
+    int64_t v = readField(value, field);
+    if (field.type == FieldType::UINT32) v -= INT64_C(0x80000000);
+    return static_cast<int32_t>(v);
+}
+
+int64_t BPlusTree::zoneDecode(uint32_t f, int32_t stored) const {
+    int64_t v = stored;
+    if (m_header.zoneFields[f].type == FieldType::UINT32) v += INT64_C(0x80000000);
+    return v;
+}
+
+void BPlusTree::leafZones(const LeafNode &leaf, ZoneRange out[ZONE_MAX_FIELDS]) const {
+    for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) out[f] = ZoneRange{INT32_MAX, INT32_MIN};
+    for (uint32_t f = 0; f < m_header.zoneFieldCount; ++f) {
+        for (uint32_t i = 0; i < leaf.hdr.numKeys; ++i) {
+            int32_t v = zoneEncode(f, leaf.values[i]);
+            out[f].min = std::min(out[f].min, v);
+            out[f].max = std::max(out[f].max, v);
+        }
+    }
+}
+
+void BPlusTree::internalZones(const InternalNode &node, ZoneRange out[ZONE_MAX_FIELDS]) const {
+    for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) out[f] = ZoneRange{INT32_MAX, INT32_MIN};
+    for (uint32_t f = 0; f < m_header.zoneFieldCount; ++f) {
+        for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) {
+            out[f].min = std::min(out[f].min, node.zones[f][i].min);
+            out[f].max = std::max(out[f].max, node.zones[f][i].max);
+        }
+    }
+}
+
+bool BPlusTree::nodeZones(uint32_t pageId, ZoneRange out[ZONE_MAX_FIELDS]) {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(pageId, buf.data())) return false;
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        leafZones(leaf, out);
+    } else {
+        InternalNode node{};
+        std::memcpy(&node, buf.data(), sizeof(node));
+        internalZones(node, out);
+    }
+    return true;
+}
+
+bool BPlusTree::setChildZones(InternalNode &node, uint32_t idx, uint32_t childPage) {
+    if (!zonesEnabled()) return true;
+    ZoneRange z[ZONE_MAX_FIELDS];
+    if (!nodeZones(childPage, z)) return false;
+    for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) node.zones[f][idx] = z[f];
+    return true;
+}
+
+bool BPlusTree::widenZones(const std::vector<uint32_t> &path, const uint8_t value[VALUE_SIZE]) {
+    int32_t v[ZONE_MAX_FIELDS] = {};
+    for (uint32_t f = 0; f < m_header.zoneFieldCount; ++f) v[f] = zoneEncode(f, value);
+
+    // Walk up from the leaf's parent; once an entry already covers the
+    // value, every entry above it does too
+    for (size_t i = path.size(); i-- > 1;) {
+        InternalNode parent{};
+        if (!readInternal(path[i - 1], parent)) return false;
+        uint32_t idx = 0;
+        while (idx <= parent.hdr.numKeys && parent.children[idx] != path[i]) ++idx;
+        if (idx > parent.hdr.numKeys) return false;
+        bool changed = false;
+        for (uint32_t f = 0; f < m_header.zoneFieldCount; ++f) {
+            ZoneRange &z = parent.zones[f][idx];
+            if (v[f] < z.min) { z.min = v[f]; changed = true; }
+            if (v[f] > z.max) { z.max = v[f]; changed = true; }
+        }
+        if (!changed) break;
+        if (!writeInternal(path[i - 1], parent)) return false;
+    }
+    return true;
+}
+
+bool BPlusTree::rebuildZones(uint32_t pageId, ZoneRange out[ZONE_MAX_FIELDS]) {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(pageId, buf.data())) return false;
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        leafZones(leaf, out);
+        return true;
+    }
+    InternalNode node{};
+    std::memcpy(&node, buf.data(), sizeof(node));
+    for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) {
+        ZoneRange z[ZONE_MAX_FIELDS];
+        if (!rebuildZones(node.children[i], z)) return false;
+        for (uint32_t f = 0; f < ZONE_MAX_FIELDS; ++f) node.zones[f][i] = z[f];
+    }
+    if (!writeInternal(pageId, node)) return false;
+    internalZones(node, out);
+    return true;
+}
+
+bool BPlusTree::setZoneMapFields(const std::vector<FieldDesc> &fields) {
+    if (!isWritable() || fields.size() > ZONE_MAX_FIELDS) return false;
+    for (const FieldDesc &f : fields) {
+        if (!fieldFits(f) || fieldWidth(f.type) > 4) return false;
+    }
+    m_header.zoneFieldCount = static_cast<uint32_t>(fields.size());
+    std::memset(m_header.zoneFields, 0, sizeof(m_header.zoneFields));
+    std::copy(fields.begin(), fields.end(), m_header.zoneFields);
+    if (zonesEnabled()) {
+        ZoneRange root[ZONE_MAX_FIELDS];
+        if (!rebuildZones(m_header.rootPage, root)) {
+            m_header.zoneFieldCount = 0;
+            flushHeader();
+            return false;
+        }
+    }
+    return flushHeader();
+}
+
+uint32_t BPlusTree::recordHash(int32_t key, const uint8_t value[VALUE_SIZE]) {
+    uint64_t h = (static_cast<uint64_t>(static_cast<uint32_t>(key)) << 32) |
+                 crc32c(value, VALUE_SIZE, static_cast<uint32_t>(key));
+    // murmur3 finalizer: hides the CRC's linearity, since hashes are summed
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return static_cast<uint32_t>(h);
+}
+
+uint32_t BPlusTree::leafHash(const LeafNode &leaf) {
+    uint32_t h = 0;
+    for (uint32_t i = 0; i < leaf.hdr.numKeys; ++i) h += recordHash(leaf.keys[i], leaf.values[i]);
+    return h;
+}
+
+uint32_t BPlusTree::internalHash(const InternalNode &node) {
+    uint32_t h = 0;
+    for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) h += node.hashes[i];
+    return h;
+}
+
+bool BPlusTree::nodeHash(uint32_t pageId, uint32_t &hash) {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(pageId, buf.data())) return false;
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        hash = leafHash(leaf);
+    } else {
+        InternalNode node{};
+        std::memcpy(&node, buf.data(), sizeof(node));
+        hash = internalHash(node);
+    }
+    return true;
+}
+
+bool BPlusTree::setChildHash(InternalNode &node, uint32_t idx, uint32_t childPage) {
+    if (!hashesEnabled()) return true;
+    return nodeHash(childPage, node.hashes[idx]);
+}
+
+bool BPlusTree::refreshHashes(const std::vector<uint32_t> &path) {
+    if (!hashesEnabled() || path.empty()) return true;
+    // Walk up from the leaf. Splits below may have set an entry already,
+    // so an unchanged entry does not mean the ones above are current.
+    uint32_t h = 0;
+    if (!nodeHash(path.back(), h)) return false;
+    for (size_t i = path.size(); i-- > 1;) {
+        InternalNode parent{};
+        if (!readInternal(path[i - 1], parent)) return false;
+        uint32_t idx = 0;
+        while (idx <= parent.hdr.numKeys && parent.children[idx] != path[i]) ++idx;
+        if (idx > parent.hdr.numKeys) return false;
+        if (parent.hashes[idx] != h) {
+            parent.hashes[idx] = h;
+            if (!writeInternal(path[i - 1], parent)) return false;
+        }
+        h = internalHash(parent);
+    }
+    return true;
+}
+
+bool BPlusTree::rebuildHashes(uint32_t pageId, uint32_t &hash) {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(pageId, buf.data())) return false;
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        hash = leafHash(leaf);
+        return true;
+    }
+    InternalNode node{};
+    std::memcpy(&node, buf.data(), sizeof(node));
+    for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) {
+        if (!rebuildHashes(node.children[i], node.hashes[i])) return false;
+    }
+    if (!writeInternal(pageId, node)) return false;
+    hash = internalHash(node);
+    return true;
+}
+
+bool BPlusTree::setSubtreeHashes(bool enabled) {
+    if (!isWritable()) return false;
+    if (enabled == hashesEnabled()) return true;
+    if (enabled) {
+        // set the flag only once every hash is in place
+        uint32_t root = 0;
+        if (!rebuildHashes(m_header.rootPage, root)) return false;
+        m_header.flags |= FILE_FLAG_HASHES;
+    } else {
+        m_header.flags &= ~FILE_FLAG_HASHES;
+    }
+    return flushHeader();
+}
+
+bool BPlusTree::diff(BPlusTree &left, BPlusTree &right, const DiffFn &fn) {
+    if (!left.isOk() || !right.isOk()) return false;
+    bool stopped = false;
+    return diffNodes(left, left.m_header.rootPage, right, right.m_header.rootPage,
+                     INT64_MIN, INT64_MAX, fn, stopped);
+}
+
+bool BPlusTree::diffNodes(BPlusTree &left, uint32_t leftPage, BPlusTree &right, uint32_t rightPage,
+                          int64_t low, int64_t high, const DiffFn &fn, bool &stopped) {
+    if (!left.hashesEnabled() || !right.hashesEnabled()) {
+        return diffRange(left, right, low, high, fn, stopped);
+    }
+    std::array<uint8_t, PAGE_SIZE> bufA{};
+    std::array<uint8_t, PAGE_SIZE> bufB{};
+    if (!left.readPage(leftPage, bufA.data()) || !right.readPage(rightPage, bufB.data())) {
+        return false;
+    }
+    NodeHeader ha{};
+    NodeHeader hb{};
+    std::memcpy(&ha, bufA.data(), sizeof(ha));
+    std::memcpy(&hb, bufB.data(), sizeof(hb));
+    if (ha.type == static_cast<uint8_t>(NodeType::LEAF) ||
+        hb.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        return diffRange(left, right, low, high, fn, stopped);
+    }
+    InternalNode a{};
+    InternalNode b{};
+    std::memcpy(&a, bufA.data(), sizeof(a));
+    std::memcpy(&b, bufB.data(), sizeof(b));
+    if (internalHash(a) == internalHash(b)) return true;
+
+    // Cut [low, high) at the separators both nodes share. Each piece is
+    // covered by a run of children on either side; equal hash sums mean
+    // equal contents, one child on each side is compared recursively, and
+    // anything else record by record.
+    auto upper = [high](const InternalNode &n, uint32_t child) -> int64_t {
+        return child < n.hdr.numKeys ? n.keys[child] : high;
+    };
+    uint32_t i = 0;
+    uint32_t j = 0;
+    int64_t pieceLow = low;
+    while (i <= a.hdr.numKeys && j <= b.hdr.numKeys) {
+        const uint32_t firstA = i;
+        const uint32_t firstB = j;
+        uint32_t sumA = a.hashes[i];
+        uint32_t sumB = b.hashes[j];
+        int64_t endA = upper(a, i++);
+        int64_t endB = upper(b, j++);
+        while (endA != endB) {
+            if (endA < endB) {
+                if (i > a.hdr.numKeys) return false; // separators outside [low, high)
+                sumA += a.hashes[i];
+                endA = upper(a, i++);
+            } else {
+                if (j > b.hdr.numKeys) return false;
+                sumB += b.hashes[j];
+                endB = upper(b, j++);
+            }
+        }
+        if (sumA != sumB) {
+            bool ok = i - firstA == 1 && j - firstB == 1
+                          ? diffNodes(left, a.children[firstA], right, b.children[firstB],
+                                      pieceLow, endA, fn, stopped)
+                          : diffRange(left, right, pieceLow, endA, fn, stopped);
+            if (!ok || stopped) return ok;
+        }
+        pieceLow = endA;
+    }
+    return true;
+}
+
+bool BPlusTree::diffRange(BPlusTree &left, BPlusTree &right, int64_t low, int64_t high,
+                          const DiffFn &fn, bool &stopped) {
+    if (low >= high || low > INT32_MAX) return true;
+    const int32_t from = static_cast<int32_t>(std::max<int64_t>(low, INT32_MIN));
+    std::unique_ptr<LeafCursor> a(new LeafCursor());
+    std::unique_ptr<LeafCursor> b(new LeafCursor());
+    bool va = left.cursorSeek(*a, from) && a->leaf.keys[a->idx] < high;
+    bool vb = right.cursorSeek(*b, from) && b->leaf.keys[b->idx] < high;
+    while (va || vb) {
+        int64_t ka = va ? a->leaf.keys[a->idx] : INT64_MAX;
+        int64_t kb = vb ? b->leaf.keys[b->idx] : INT64_MAX;
+        const uint8_t *valueA = ka <= kb ? a->leaf.values[a->idx] : nullptr;
+        const uint8_t *valueB = kb <= ka ? b->leaf.values[b->idx] : nullptr;
+        bool differs = !valueA || !valueB || std::memcmp(valueA, valueB, VALUE_SIZE) != 0;
+        if (differs && !fn(static_cast<int32_t>(std::min(ka, kb)), valueA, valueB)) {
+            stopped = true;
+            return true;
+        }
+        if (valueA) va = left.cursorNext(*a) && a->leaf.keys[a->idx] < high;
+        if (valueB) vb = right.cursorNext(*b) && b->leaf.keys[b->idx] < high;
+    }
+    return !a->failed && !b->failed;
+}
+
+bool BPlusTree::scanFiltered(int32_t lowerKey, int32_t upperKey, const FieldDesc &field,
+                             int64_t minValue, int64_t maxValue, std::vector<Record> &records) {
+    records.clear();
+    if (!isOk() || !fieldFits(field)) return false;
+    if (lowerKey > upperKey || minValue > maxValue) return true;
+    ScanFilter filter{lowerKey, upperKey, field, -1, minValue, maxValue};
+    for (uint32_t f = 0; f < m_header.zoneFieldCount; ++f) {
+        if (m_header.zoneFields[f].offset == field.offset &&
+            m_header.zoneFields[f].type == field.type) {
+            filter.zone = static_cast<int>(f);
+        }
+    }
+    // a failed read must not pass for a complete result
+    if (!scanFilteredNode(m_header.rootPage, filter, records)) {
+        records.clear();
+        return false;
+    }
+    return true;
+}
+
+bool BPlusTree::scanFilteredNode(uint32_t pageId, const ScanFilter &filter,
+                                 std::vector<Record> &out) {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(pageId, buf.data())) return false;
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        uint32_t i = 0;
+        searchInLeaf(leaf, filter.lowerKey, i);
+        for (; i < leaf.hdr.numKeys && leaf.keys[i] <= filter.upperKey; ++i) {
+            int64_t v = readField(leaf.values[i], filter.field);
+            if (v < filter.minValue || v > filter.maxValue) continue;
+            Record r{};
+            r.key = leaf.keys[i];
+            std::memcpy(r.value.data(), leaf.values[i], VALUE_SIZE);
+            out.push_back(r);
+        }
+        return true;
+    }
+
+    InternalNode node{};
+    std::memcpy(&node, buf.data(), sizeof(node));
+    for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) {
+        // child i holds keys in [keys[i - 1], keys[i])
+        if (i < node.hdr.numKeys && node.keys[i] <= filter.lowerKey) continue;
+        if (i > 0 && node.keys[i - 1] > filter.upperKey) break;
+        if (filter.zone >= 0) {
+            const ZoneRange &z = node.zones[filter.zone][i];
+            if (z.min > z.max) continue;
+            if (zoneDecode(filter.zone, z.max) < filter.minValue ||
+                zoneDecode(filter.zone, z.min) > filter.maxValue) {
+                continue;
+            }
+        }
+        if (!scanFilteredNode(node.children[i], filter, out)) return false;
+    }
+    return true;
+}
+
+ScanCursor BPlusTree::openScan(int32_t lowerKey, int32_t upperKey) const {
+    return ScanCursor{lowerKey, upperKey, lowerKey > upperKey, false};
+}
+
+bool BPlusTree::scanBatch(ScanCursor &cursor, ColumnBatch &batch) {
+    batch.count = 0;
+    if (cursor.done || batch.capacity == 0) return false;
+    auto fail = [&]() {
+        // partial rows would look like a complete batch
+        batch.count = 0;
+        cursor.done = true;
+        cursor.failed = true;
+        return false;
+    };
+    if (!isOk()) return fail();
+
+    uint32_t leafPage = findLeafPage(cursor.nextKey, nullptr);
+    if (leafPage == INVALID_PAGE) return fail();
+    bool first = true;
+    while (leafPage != INVALID_PAGE && batch.count < batch.capacity) {
+        LeafNode leaf{};
+        if (!readLeaf(leafPage, leaf)) return fail();
+        uint32_t begin = 0;
+        if (first) searchInLeaf(leaf, cursor.nextKey, begin);
+        first = false;
+        uint32_t end = begin;
+        while (end < leaf.hdr.numKeys && leaf.keys[end] <= cursor.upperKey &&
+               batch.count + (end - begin) < batch.capacity) {
+            ++end;
+        }
+        uint32_t n = end - begin;
+        if (n > 0) {
+            std::memcpy(batch.keys + batch.count, &leaf.keys[begin], n * sizeof(int32_t));
+            if (batch.values) {
+                std::memcpy(batch.values + batch.count * VALUE_SIZE, leaf.values[begin],
+                            static_cast<size_t>(n) * VALUE_SIZE);
+            }
+            batch.count += n;
+        }
+        if (end < leaf.hdr.numKeys) {
+            // stopped inside this leaf: either past upperKey or the batch is full
+            if (leaf.keys[end] > cursor.upperKey) cursor.done = true;
+            break;
+        }
+        leafPage = leaf.nextLeaf;
+    }
+    if (leafPage == INVALID_PAGE) cursor.done = true;
+
+    if (batch.count > 0) {
+        int32_t last = batch.keys[batch.count - 1];
+        if (last >= cursor.upperKey) {
+            cursor.done = true;
+        } else {
+            cursor.nextKey = last + 1;
+        }
+    }
+    return batch.count > 0;
+}
+
+uint32_t BPlusTree::findLeafShared(int32_t key) {
+    uint32_t page = m_header.rootPage;
+    while (true) {
+        InternalNode node{};
+        if (!readInternal(page, node)) return INVALID_PAGE;
+        if (node.hdr.type == static_cast<uint8_t>(NodeType::LEAF)) return page;
+        uint32_t i = static_cast<uint32_t>(
+            std::upper_bound(node.keys, node.keys + node.hdr.numKeys, key) - node.keys);
+        page = node.children[i];
+    }
+}
+
+bool BPlusTree::sharedPass(int32_t lowerKey, int32_t upperKey, SharedScan *self,
+                           const std::function<bool(int32_t key, const uint8_t *value)> &fn,
+                           bool &stopped) {
+    uint32_t leafPage = findLeafShared(lowerKey);
+    if (leafPage == INVALID_PAGE) return false;
+    LeafNode leaf{};
+    while (leafPage != INVALID_PAGE) {
+        if (!readLeaf(leafPage, leaf)) return false;
+        uint32_t i = 0;
+        searchInLeaf(leaf, lowerKey, i);
+        if (self && i < leaf.hdr.numKeys) self->position = leaf.keys[i];
+        for (; i < leaf.hdr.numKeys; ++i) {
+            if (leaf.keys[i] > upperKey) return true;
+            if (!fn(leaf.keys[i], leaf.values[i])) {
+                stopped = true;
+                return true;
+            }
+        }
+        leafPage = leaf.nextLeaf;
+    }
+    return true;
+}
+
+bool BPlusTree::scanShared(int32_t lowerKey, int32_t upperKey,
+                           const std::function<bool(int32_t key, const uint8_t *value)> &fn) {
+    if (!isOk()) return false;
+    if (lowerKey > upperKey) return true;
+
+    // Attach to the running scan that will cover most of our range from
+    // where it is now; its leaves are being read into the cache anyway
+    SharedScan self;
+    self.upperKey = upperKey;
+    int32_t start = lowerKey;
+    {
+        std::lock_guard<std::mutex> lock(m_sharedScanMutex);
+        int64_t bestOverlap = 0;
+        for (const SharedScan *s : m_sharedScans) {
+            int32_t p = s->position;
+            if (p <= lowerKey || p > upperKey) continue;
+            int64_t overlap = static_cast<int64_t>(std::min(upperKey, s->upperKey)) - p;
+            if (overlap > bestOverlap) {
+                bestOverlap = overlap;
+                start = p;
+            }
+        }
+        self.position = start;
+        m_sharedScans.push_back(&self);
+    }
+
+    bool stopped = false;
+    bool ok = sharedPass(start, upperKey, &self, fn, stopped);
+    {
+        std::lock_guard<std::mutex> lock(m_sharedScanMutex);
+        m_sharedScans.erase(std::find(m_sharedScans.begin(), m_sharedScans.end(), &self));
+    }
+    // the prefix missed by attaching late
+    if (ok && !stopped && start > lowerKey) ok = sharedPass(lowerKey, start - 1, nullptr, fn, stopped);
+    return ok;
+}
+
+bool BPlusTree::scanPhysical(const std::function<bool(int32_t key, const uint8_t *value)> &fn) {
+    if (!isOk()) return false;
+
+    // Reachable leaves, found from the internal nodes only. Pages that look
+    // like leaves but are not linked into the tree (e.g. left behind by a
+    // crash during a split) are not reported.
+    std::vector<std::pair<int32_t, uint32_t>> leaves;
+    if (!collectLevel(0, leaves)) return false;
+    uint32_t maxPage = 0;
+    for (const auto &l : leaves) maxPage = std::max(maxPage, l.second);
+    std::vector<bool> isLeaf(static_cast<size_t>(maxPage) + 1, false);
+    for (const auto &l : leaves) isLeaf[l.second] = true;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    std::vector<uint8_t> chunk(static_cast<size_t>(PHYSICAL_SCAN_CHUNK_PAGES) * PAGE_SIZE);
+    for (uint32_t first = 1; first <= maxPage; first += PHYSICAL_SCAN_CHUNK_PAGES) {
+        uint32_t pages = std::min(PHYSICAL_SCAN_CHUNK_PAGES, maxPage - first + 1);
+        ssize_t n = ::pread(m_fd, chunk.data(), static_cast<size_t>(pages) * PAGE_SIZE,
+                            static_cast<off_t>(pageOffset(first)));
+        if (n != static_cast<ssize_t>(static_cast<size_t>(pages) * PAGE_SIZE)) return false;
+        for (uint32_t p = 0; p < pages; ++p) {
+            if (!isLeaf[first + p]) continue;
+            const uint8_t *page = chunk.data() + static_cast<size_t>(p) * PAGE_SIZE;
+            if (!verifyPage(first + p, page)) return false;
+            NodeHeader nh{};
+            std::memcpy(&nh, page, sizeof(nh));
+            if (nh.type != static_cast<uint8_t>(NodeType::LEAF)) return false;
+            LeafNode leaf{};
+            std::memcpy(&leaf, page, sizeof(leaf));
+            for (uint32_t i = 0; i < leaf.hdr.numKeys; ++i) {
+                if (!fn(leaf.keys[i], leaf.values[i])) return true;
+            }
+        }
+    }
+    return true;
+}
+
+std::vector<Record> BPlusTree::readRanges(std::vector<std::pair<int32_t, int32_t>> ranges) {
+    std::vector<Record> out;
+    if (!isOk()) return out;
+
+    // normalise: sorted, disjoint, non-empty
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(),
+                                [](const std::pair<int32_t, int32_t> &r) { return r.first > r.second; }),
+                 ranges.end());
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<int32_t, int32_t>> merged;
+    for (const auto &r : ranges) {
+        if (!merged.empty() && static_cast<int64_t>(r.first) <= static_cast<int64_t>(merged.back().second) + 1) {
+            merged.back().second = std::max(merged.back().second, r.second);
+        } else {
+            merged.push_back(r);
+        }
+    }
+
+    LeafNode leaf{};
+    uint32_t leafPage = INVALID_PAGE;
+    for (const auto &r : merged) {
+        // Locate the leaf for r.first unless it is the one already loaded
+        if (leafPage == INVALID_PAGE || leaf.hdr.numKeys == 0 ||
+            r.first > leaf.keys[leaf.hdr.numKeys - 1]) {
+            uint32_t target = findLeafPage(r.first, nullptr);
+            if (target == INVALID_PAGE) return out;
+            if (target != leafPage) {
+                if (!readLeaf(target, leaf)) return out;
+                leafPage = target;
+            }
+        }
+
+        uint32_t i = 0;
+        searchInLeaf(leaf, r.first, i);
+        while (true) {
+            for (; i < leaf.hdr.numKeys && leaf.keys[i] <= r.second; ++i) {
+                Record rec{};
+                rec.key = leaf.keys[i];
+                std::memcpy(rec.value.data(), leaf.values[i], VALUE_SIZE);
+                out.push_back(rec);
+            }
+            if (i < leaf.hdr.numKeys) break; // range ends inside this leaf
+            if (leaf.nextLeaf == INVALID_PAGE) return out;
+            leafPage = leaf.nextLeaf;
+            if (!readLeaf(leafPage, leaf)) return out;
+            i = 0;
+        }
+    }
+    return out;
+}
+
+bool BPlusTree::cursorSeek(LeafCursor &c, int32_t key) {
+    if (c.page == INVALID_PAGE || c.leaf.hdr.numKeys == 0 ||
+        key > c.leaf.keys[c.leaf.hdr.numKeys - 1]) {
+        // Not in the loaded leaf: descend instead of walking the chain,
+        // which skips every leaf in between
+        uint32_t target = findLeafPage(key, nullptr);
+        if (target == INVALID_PAGE) {
+            c.failed = true;
+            return false;
+        }
+        if (target != c.page) {
+            if (!readLeaf(target, c.leaf)) {
+                c.failed = true;
+                return false;
+            }
+            c.page = target;
+            c.idx = 0;
+        }
+    }
+    uint32_t idx = 0;
+    searchInLeaf(c.leaf, key, idx);
+    c.idx = std::max(c.idx, idx);
+    return cursorSettle(c);
+}
+
+bool BPlusTree::cursorNext(LeafCursor &c) {
+    ++c.idx;
+    return cursorSettle(c);
+}
+
+bool BPlusTree::cursorSettle(LeafCursor &c) {
+    while (c.idx >= c.leaf.hdr.numKeys) {
+        if (c.leaf.nextLeaf == INVALID_PAGE) return false;
+        c.page = c.leaf.nextLeaf;
+        c.idx = 0;
+        if (!readLeaf(c.page, c.leaf)) {
+            c.failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BPlusTree::mergeJoin(BPlusTree &left, BPlusTree &right,
+                          const std::function<bool(int32_t key, const uint8_t *leftValue,
+                                                   const uint8_t *rightValue)> &fn) {
+    if (!left.isOk() || !right.isOk()) return false;
+    std::unique_ptr<LeafCursor> a(new LeafCursor());
+    std::unique_ptr<LeafCursor> b(new LeafCursor());
+    bool va = left.cursorSeek(*a, INT32_MIN);
+    bool vb = right.cursorSeek(*b, INT32_MIN);
+    while (va && vb) {
+        int32_t ka = a->leaf.keys[a->idx];
+        int32_t kb = b->leaf.keys[b->idx];
+        if (ka == kb) {
+            if (!fn(ka, a->leaf.values[a->idx], b->leaf.values[b->idx])) return true;
+            va = left.cursorNext(*a);
+            vb = right.cursorNext(*b);
+        } else if (ka < kb) {
+            va = left.cursorSeek(*a, kb);
+        } else {
+            vb = right.cursorSeek(*b, ka);
+        }
+    }
+    return !a->failed && !b->failed;
+}
+
+std::string BPlusTree::indexFileName(const FieldDesc &field) const {
+    return m_filename + ".idx-" + std::to_string(field.offset) + "-" +
+           std::to_string(static_cast<unsigned>(field.type));
+}
+
+int BPlusTree::findIndex(const FieldDesc &field) const {
+    for (uint32_t i = 0; i < m_header.indexFieldCount; ++i) {
+        if (m_header.indexFields[i].offset == field.offset &&
+            m_header.indexFields[i].type == field.type) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+bool BPlusTree::openIndexes() {
+    m_indexes.clear();
+    if (m_header.indexFieldCount > INDEX_MAX_FIELDS) return false;
+    for (uint32_t i = 0; i < m_header.indexFieldCount; ++i) {
+        std::string name = indexFileName(m_header.indexFields[i]);
+        // a missing index file is rebuilt from the tree
+        bool missing = !fileExists(name);
+        if (missing && !isWritable()) return false;
+        m_indexes.emplace_back(new SecondaryIndex(name));
+        if (!m_indexes.back()->isOk()) {
+            // torn by a crash while it was being built: rebuild it too. A
+            // read-only tree keeps it, and lookups through it fail.
+            std::cerr << "Invalid secondary index " << name
+                      << (isWritable() ? ", rebuilding it\n" : ", not using it\n");
+            missing = isWritable();
+        }
+        if (missing && !buildIndex(i)) return false;
+    }
+    return true;
+}
+
+uint64_t BPlusTree::indexKey(const FieldDesc &field, const uint8_t value[VALUE_SIZE],
+                             int32_t key) {
+    // UINT32 is stored as is, all narrower and signed types shifted by 2^31
+    int64_t v = readField(value, field);
+    if (field.type != FieldType::UINT32) v += INT64_C(0x80000000);
+    uint32_t k = static_cast<uint32_t>(key) ^ 0x80000000u;
+    return (static_cast<uint64_t>(static_cast<uint32_t>(v)) << 32) | k;
+}
+
+bool BPlusTree::buildIndex(uint32_t i) {
+    const FieldDesc field = m_header.indexFields[i];
+    std::vector<uint64_t> keys;
+    bool ok = scanPhysical([&](int32_t key, const uint8_t *value) {
+        keys.push_back(indexKey(field, value, key));
+        return true;
+    });
+    if (!ok) return false;
+    std::sort(keys.begin(), keys.end());
+    return m_indexes[i]->bulkLoad(keys);
+}
+
+bool BPlusTree::updateIndexes(int32_t key, const uint8_t *oldValue, const uint8_t *newValue) {
+    for (uint32_t i = 0; i < m_indexes.size(); ++i) {
+        const FieldDesc &field = m_header.indexFields[i];
+        uint64_t oldKey = oldValue ? indexKey(field, oldValue, key) : 0;
+        uint64_t newKey = newValue ? indexKey(field, newValue, key) : 0;
+        if (oldValue && newValue && oldKey == newKey) continue;
+        if (oldValue && !m_indexes[i]->erase(oldKey)) return false;
+        if (newValue && !m_indexes[i]->insert(newKey)) return false;
+    }
+    return true;
+}
+
+bool BPlusTree::createIndex(const FieldDesc &field) {
+    if (!isWritable() || !fieldFits(field) || fieldWidth(field.type) > 4) return false;
+    if (findIndex(field) >= 0) return true;
+    if (m_header.indexFieldCount == INDEX_MAX_FIELDS) return false;
+
+    uint32_t i = m_header.indexFieldCount;
+    std::unique_ptr<SecondaryIndex> index(new SecondaryIndex(indexFileName(field)));
+    if (!index->isOk()) return false;
+    m_header.indexFields[i] = field;
+    m_indexes.push_back(std::move(index));
+    if (!buildIndex(i)) {
+        m_indexes.pop_back();
+        ::unlink(indexFileName(field).c_str());
+        return false;
+    }
+    ++m_header.indexFieldCount;
+    return flushHeader();
+}
+
+bool BPlusTree::dropIndex(const FieldDesc &field) {
+    if (!isWritable()) return false;
+    int i = findIndex(field);
+    if (i < 0) return false;
+    m_indexes.erase(m_indexes.begin() + i);
+    std::copy(m_header.indexFields + i + 1, m_header.indexFields + m_header.indexFieldCount,
+              m_header.indexFields + i);
+    --m_header.indexFieldCount;
+    bool ok = flushHeader();
+    ::unlink(indexFileName(field).c_str());
+    return ok;
+}
+
+bool BPlusTree::lookupKeysByField(const FieldDesc &field, int64_t minValue, int64_t maxValue,
+                                  std::vector<std::pair<int64_t, int32_t>> &entries) {
+    entries.clear();
+    if (!isOk()) return false;
+    int i = findIndex(field);
+    if (i < 0 || !m_indexes[i]->isOk()) return false;
+
+    // clamp to what the stored 32-bit form can represent
+    const bool isUnsigned = field.type == FieldType::UINT32;
+    const int64_t bias = isUnsigned ? 0 : INT64_C(0x80000000);
+    minValue = std::max(minValue, -bias);
+    maxValue = std::min(maxValue, INT64_C(0xFFFFFFFF) - bias);
+    if (minValue > maxValue) return true;
+
+    uint64_t lower = static_cast<uint64_t>(minValue + bias) << 32;
+    uint64_t upper = (static_cast<uint64_t>(maxValue + bias) << 32) | 0xFFFFFFFFu;
+    return m_indexes[i]->scan(lower, upper, [&](uint64_t k) {
+        int64_t v = static_cast<int64_t>(k >> 32) - bias;
+        int32_t key = static_cast<int32_t>(static_cast<uint32_t>(k) ^ 0x80000000u);
+        entries.emplace_back(v, key);
+        return true;
+    });
+}
+
+bool BPlusTree::lookupByField(const FieldDesc &field, int64_t minValue, int64_t maxValue,
+                              std::vector<Record> &records) {
+    records.clear();
+    std::vector<std::pair<int64_t, int32_t>> entries;
+    if (!lookupKeysByField(field, minValue, maxValue, entries)) return false;
+    std::vector<int32_t> keys;
+    keys.reserve(entries.size());
+    for (const auto &e : entries) keys.push_back(e.second);
+    std::sort(keys.begin(), keys.end());
+    // a stale entry can repeat a key
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    // one forward pass: each seek stays in the loaded leaf or skips ahead
+    std::unique_ptr<LeafCursor> c(new LeafCursor());
+    for (int32_t key : keys) {
+        if (!cursorSeek(*c, key)) break;
+        if (c->leaf.keys[c->idx] != key) continue; // index ahead of the tree
+        // the entry may be stale: the record must still match
+        int64_t v = readField(c->leaf.values[c->idx], field);
+        if (v < minValue || v > maxValue) continue;
+        Record r{};
+        r.key = key;
+        std::memcpy(r.value.data(), c->leaf.values[c->idx], VALUE_SIZE);
+        records.push_back(r);
+    }
+    return !c->failed;
+}
+
+bool BPlusTree::setOpenFlag(bool open) {
+    if (open) {
+        m_header.flags |= FILE_FLAG_OPEN;
+    } else {
+        m_header.flags &= ~FILE_FLAG_OPEN;
+    }
+    // the flag must reach the disk before any write it protects
+    return flushHeader() && (!open || ::fdatasync(m_fd) == 0);
+}
+
+bool BPlusTree::readPageDirect(uint32_t pageId, uint8_t *page) {
+    if (m_map) {
+        if (pageOffset(pageId) + PAGE_SIZE > m_mapSize) return false;
+        std::memcpy(page, m_map + pageOffset(pageId), PAGE_SIZE);
+        return true;
+    }
+    return ::pread(m_fd, page, PAGE_SIZE, static_cast<off_t>(pageOffset(pageId))) ==
+           static_cast<ssize_t>(PAGE_SIZE);
+}
+
+void BPlusTree::checkNode(const CheckTask &task, uint32_t pageCount, CheckResult &result,
+                          std::vector<CheckTask> *children) {
+    auto fail = [&](const std::string &what) {
+        if (result.errors.size() < CHECK_MAX_ERRORS) {
+            result.errors.push_back("page " + std::to_string(task.page) + ": " + what);
+        }
+    };
+    result.pages.push_back(task.page);
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPageDirect(task.page, buf.data())) {
+        fail("cannot be read");
+        return;
+    }
+    if (checksumsEnabled()) {
+        uint32_t stored = 0;
+        std::memcpy(&stored, buf.data() + offsetof(NodeHeader, checksum), sizeof(stored));
+        if (stored != pageChecksum(buf.data())) fail("checksum mismatch");
+    }
+
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+    const bool leafLevel = task.depth + 1 == m_height;
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        if (!leafLevel) fail("leaf at depth " + std::to_string(task.depth));
+        if (leaf.hdr.numKeys > LEAF_MAX_KEYS) {
+            fail("bad key count " + std::to_string(leaf.hdr.numKeys));
+            return;
+        }
+        for (uint32_t i = 0; i < leaf.hdr.numKeys; ++i) {
+            if (i > 0 && leaf.keys[i] <= leaf.keys[i - 1]) fail("keys out of order at " + std::to_string(i));
+            if (leaf.keys[i] < task.low || leaf.keys[i] >= task.high) {
+                fail("key " + std::to_string(leaf.keys[i]) + " outside its parent's bounds");
+            }
+        }
+        // leaves are visited in key order, so each must follow the previous one
+        if (result.lastLeaf != INVALID_PAGE && result.lastNext != task.page) {
+            fail("leaf chain: page " + std::to_string(result.lastLeaf) + " links to " +
+                 std::to_string(result.lastNext));
+        }
+        if (result.firstLeaf == INVALID_PAGE) result.firstLeaf = task.page;
+        result.lastLeaf = task.page;
+        result.lastNext = leaf.nextLeaf;
+        return;
+    }
+    if (nh.type != static_cast<uint8_t>(NodeType::INTERNAL)) {
+        fail("unknown node type " + std::to_string(nh.type));
+        return;
+    }
+
+    InternalNode node{};
+    std::memcpy(&node, buf.data(), sizeof(node));
+    if (leafLevel) fail("internal node at leaf depth");
+    if (node.hdr.numKeys == 0 || node.hdr.numKeys > INTERNAL_MAX_KEYS) {
+        fail("bad key count " + std::to_string(node.hdr.numKeys));
+        return;
+    }
+    for (uint32_t i = 0; i < node.hdr.numKeys; ++i) {
+        if (i > 0 && node.keys[i] <= node.keys[i - 1]) fail("keys out of order at " + std::to_string(i));
+        if (node.keys[i] < task.low || node.keys[i] >= task.high) {
+            fail("separator " + std::to_string(node.keys[i]) + " outside its parent's bounds");
+        }
+    }
+    if (leafLevel) return;
+    for (uint32_t i = 0; i <= node.hdr.numKeys; ++i) {
+        uint32_t child = node.children[i];
+        if (child == 0 || child >= pageCount) {
+            fail("child " + std::to_string(i) + " points to page " + std::to_string(child));
+            continue;
+        }
+        CheckTask sub{child, i == 0 ? task.low : node.keys[i - 1],
+                      i == node.hdr.numKeys ? task.high : node.keys[i], task.depth + 1};
+        if (children) {
+            children->push_back(sub);
+        } else {
+            checkNode(sub, pageCount, result, nullptr);
+        }
+    }
+}
+
+bool BPlusTree::setPageChecksums(bool enabled) {
+    if (!isWritable() || m_batchActive) return false;
+    if (enabled == checksumsEnabled()) return true;
+    if (enabled) {
+        // stamp every node page as it is on disk, then set the flag
+        off_t size = lseek(m_fd, 0, SEEK_END);
+        if (size < 0) return false;
+        m_header.flags |= FILE_FLAG_CHECKSUMS;
+        std::array<uint8_t, PAGE_SIZE> page{};
+        for (uint32_t p = 1; p < static_cast<uint32_t>(size / PAGE_SIZE); ++p) {
+            if (!readPageDirect(p, page.data()) || !writePage(p, page.data())) {
+                m_header.flags &= ~FILE_FLAG_CHECKSUMS;
+                return false;
+            }
+        }
+    } else {
+        m_header.flags &= ~FILE_FLAG_CHECKSUMS;
+    }
+    return flushHeader();
+}
+
+bool BPlusTree::checkIntegrity(unsigned threads, std::vector<std::string> *errors) {
+    return checkFile(threads, errors, nullptr);
+}
+
+bool BPlusTree::checkFile(unsigned threads, std::vector<std::string> *errors,
+                          std::vector<uint32_t> *unreachable) {
+    if (!isOk()) return false;
+    off_t size = m_map ? static_cast<off_t>(m_mapSize) : lseek(m_fd, 0, SEEK_END);
+    if (size < 0) return false;
+    const uint32_t pageCount = static_cast<uint32_t>(size / PAGE_SIZE);
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Expand the top levels on this thread until there are enough subtrees
+    // to keep every worker busy
+    CheckResult top;
+    std::vector<CheckTask> tasks;
+    if (m_header.rootPage == 0 || m_header.rootPage >= pageCount) {
+        top.errors.push_back("root page " + std::to_string(m_header.rootPage) + " is outside the file");
+    } else {
+        tasks.push_back(CheckTask{m_header.rootPage, INT64_MIN, INT64_MAX, 0});
+    }
+    while (!tasks.empty() && tasks.size() < threads * CHECK_TASKS_PER_THREAD &&
+           tasks[0].depth + 1 < m_height) {
+        std::vector<CheckTask> next;
+        for (const CheckTask &t : tasks) checkNode(t, pageCount, top, &next);
+        tasks.swap(next);
+    }
+
+    // Workers take subtrees in turn; results stay in key order
+    std::vector<CheckResult> results(tasks.size());
+    std::atomic<size_t> nextTask(0);
+    auto worker = [&]() {
+        for (size_t i = nextTask++; i < tasks.size(); i = nextTask++) {
+            checkNode(tasks[i], pageCount, results[i], nullptr);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < std::min<size_t>(threads, tasks.size()); ++t) pool.emplace_back(worker);
+    worker();
+    for (std::thread &t : pool) t.join();
+
+    // Stitch the leaf chain across subtrees and account for every page
+    std::vector<std::string> found = top.errors;
+    std::vector<uint8_t> seen(pageCount, 0);
+    seen[0] = 1; // file header
+    for (uint32_t p : top.pages) {
+        if (seen[p]++) found.push_back("page " + std::to_string(p) + ": referenced more than once");
+    }
+    uint32_t lastLeaf = INVALID_PAGE;
+    uint32_t lastNext = INVALID_PAGE;
+    for (const CheckResult &r : results) {
+        found.insert(found.end(), r.errors.begin(), r.errors.end());
+        for (uint32_t p : r.pages) {
+            if (seen[p]++) found.push_back("page " + std::to_string(p) + ": referenced more than once");
+        }
+        if (r.firstLeaf == INVALID_PAGE) continue;
+        if (lastLeaf != INVALID_PAGE && lastNext != r.firstLeaf) {
+            found.push_back("page " + std::to_string(lastLeaf) + ": leaf chain links to " +
+                            std::to_string(lastNext) + " instead of " + std::to_string(r.firstLeaf));
+        }
+        lastLeaf = r.lastLeaf;
+        lastNext = r.lastNext;
+    }
+    if (lastLeaf != INVALID_PAGE && lastNext != INVALID_PAGE) {
+        found.push_back("page " + std::to_string(lastLeaf) + ": last leaf links to " +
+                        std::to_string(lastNext));
+    }
+
+    // The free list: pages nothing else references, ending in INVALID_PAGE
+    for (uint32_t p = m_header.freeListHead; p != INVALID_PAGE;) {
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        bool ok = p < pageCount && !seen[p]++ && readPageDirect(p, buf.data()) &&
+                  verifyPage(p, buf.data());
+        FreePage node{};
+        if (ok) std::memcpy(&node, buf.data(), sizeof(node));
+        if (!ok || node.hdr.type != static_cast<uint8_t>(NodeType::FREE)) {
+            found.push_back("free list: bad or repeated page " + std::to_string(p));
+            break;
+        }
+        p = node.nextFree;
+    }
+
+    uint32_t unreachableCount = 0;
+    uint32_t firstUnreachable = 0;
+    for (uint32_t p = 0; p < pageCount; ++p) {
+        if (seen[p]) continue;
+        if (unreachable) unreachable->push_back(p);
+        if (unreachableCount++ == 0) firstUnreachable = p;
+    }
+    if (unreachableCount > 0 && !unreachable) {
+        found.push_back(std::to_string(unreachableCount) + " unreachable pages, the first is page " +
+                        std::to_string(firstUnreachable));
+    }
+
+    if (errors) errors->insert(errors->end(), found.begin(), found.end());
+    return found.empty();
+}
+
+void BPlusTree::preserveForBackup(uint32_t pageId) {
+    if (!m_backupActive.load()) return;
+    std::lock_guard<std::mutex> lock(m_backupMutex);
+    if (!m_backupActive || pageId >= m_backupPages || m_backupCopied[pageId] ||
+        m_backupSaved.count(pageId) != 0) {
+        return;
+    }
+    // the file still holds the snapshot image: nothing overwrote it since
+    std::array<uint8_t, PAGE_SIZE> &saved = m_backupSaved[pageId];
+    if (::pread(m_fd, saved.data(), PAGE_SIZE, static_cast<off_t>(pageOffset(pageId))) !=
+        static_cast<ssize_t>(PAGE_SIZE)) {
+        m_backupSaved.erase(pageId);
+        m_backupStop = true; // the image can no longer be consistent
+    }
+}
+
+bool BPlusTree::startBackup(int outFd, uint64_t bytesPerSecond) {
+    return beginBackup(outFd, bytesPerSecond, false, 0);
+}
+
+bool BPlusTree::startIncrementalBackup(int outFd, uint64_t sinceLsn, uint64_t bytesPerSecond) {
+    return beginBackup(outFd, bytesPerSecond, true, sinceLsn);
+}
+
+bool BPlusTree::beginBackup(int outFd, uint64_t bytesPerSecond, bool incremental, uint64_t sinceLsn) {
+    if (!isOk() || m_backupActive || m_batchActive) return false;
+    if (m_backupThread.joinable()) m_backupThread.join();
+    off_t end = lseek(m_fd, 0, SEEK_END);
+    if (end < static_cast<off_t>(PAGE_SIZE)) return false;
+    {
+        std::lock_guard<std::mutex> lock(m_backupMutex);
+        m_backupPages = static_cast<uint32_t>(end / PAGE_SIZE);
+        m_backupCopied.assign(m_backupPages, false);
+        m_backupSaved.clear();
+    }
+    m_backupIncremental = incremental;
+    m_backupSinceLsn = sinceLsn;
+    m_backupEndLsn = lastLsn();
+    m_backupChangeSeq = m_header.changeSeq;
+    // from here on every in-place write preserves the page it replaces
+    m_backupStop = false;
+    m_backupOk = false;
+    m_backupActive = true;
+    m_backupThread = std::thread(&BPlusTree::backupWorker, this, outFd, bytesPerSecond);
+    return true;
+}
+
+bool BPlusTree::finishBackup() {
+    if (m_backupThread.joinable()) m_backupThread.join();
+    return m_backupOk;
+}
+
+void BPlusTree::stopBackup() {
+    m_backupStop = true;
+    if (m_backupThread.joinable()) m_backupThread.join();
+}
+
+void BPlusTree::backupWorker(int outFd, uint64_t bytesPerSecond) {
+    using clock = std::chrono::steady_clock;
+    const clock::time_point start = clock::now();
+    std::vector<uint8_t> chunk(static_cast<size_t>(BACKUP_CHUNK_PAGES) * PAGE_SIZE);
+    std::vector<uint8_t> entries; // incremental: the chunk's changed pages
+    uint64_t checksum = journalChecksum(nullptr, 0);
+    uint64_t written = 0;
+    bool ok = true;
+
+    if (m_backupIncremental) {
+        IncrementalHeader hdr{INCREMENTAL_MAGIC, PAGE_SIZE, m_backupSinceLsn, m_backupEndLsn,
+                              m_backupPages, 0};
+        ok = writeAll(outFd, reinterpret_cast<const uint8_t *>(&hdr), sizeof(hdr));
+    }
+    for (uint32_t first = 0; ok && first < m_backupPages; first += BACKUP_CHUNK_PAGES) {
+        if (m_backupStop) {
+            ok = false;
+            break;
+        }
+        uint32_t pages = std::min(BACKUP_CHUNK_PAGES, m_backupPages - first);
+        size_t bytes = static_cast<size_t>(pages) * PAGE_SIZE;
+        {
+            // no page of the run can be overwritten between the read and
+            // marking it copied
+            std::lock_guard<std::mutex> lock(m_backupMutex);
+            ok = ::pread(m_fd, chunk.data(), bytes, static_cast<off_t>(pageOffset(first))) ==
+                 static_cast<ssize_t>(bytes);
+            for (uint32_t i = 0; ok && i < pages; ++i) {
+                auto it = m_backupSaved.find(first + i);
+                if (it != m_backupSaved.end()) {
+                    std::memcpy(chunk.data() + static_cast<size_t>(i) * PAGE_SIZE,
+                                it->second.data(), PAGE_SIZE);
+                    m_backupSaved.erase(it);
+                }
+                m_backupCopied[first + i] = true;
+            }
+        }
+        if (ok && first == 0) {
+            // the copy is complete on its own: present it as cleanly closed
+            FileHeader hdr;
+            std::memcpy(&hdr, chunk.data(), sizeof(hdr));
+            // a replica must not append to the leader's change log
+            hdr.flags &= ~(FILE_FLAG_OPEN | FILE_FLAG_CHANGE_LOG | FILE_FLAG_CHANGE_LOG_BROKEN);
+            // a replica seeded from this copy resumes the change log here
+            hdr.changeSeq = m_backupChangeSeq;
+            std::memcpy(chunk.data(), &hdr, sizeof(hdr));
+        }
+        if (ok && m_backupIncremental) {
+            entries.clear();
+            for (uint32_t i = 0; ok && i < pages; ++i) {
+                const uint8_t *page = chunk.data() + static_cast<size_t>(i) * PAGE_SIZE;
+                uint32_t pageId = first + i;
+                if (pageId != 0 && pageLsn(page) <= m_backupSinceLsn) continue;
+                ok = verifyPage(pageId, page);
+                size_t at = entries.size();
+                entries.resize(at + JOURNAL_ENTRY_SIZE);
+                std::memcpy(entries.data() + at, &pageId, sizeof(pageId));
+                std::memcpy(entries.data() + at + sizeof(pageId), page, PAGE_SIZE);
+            }
+            checksum = journalChecksum(entries.data(), entries.size(), checksum);
+            ok = ok && writeAll(outFd, entries.data(), entries.size());
+            written += entries.size();
+        } else {
+            ok = ok && writeAll(outFd, chunk.data(), bytes);
+            written += bytes;
+        }
+
+        if (bytesPerSecond != 0) {
+            auto due = start + std::chrono::duration_cast<clock::duration>(
+                                   std::chrono::duration<double>(
+                                       static_cast<double>(written) / static_cast<double>(bytesPerSecond)));
+            while (!m_backupStop && clock::now() < due) {
+                std::this_thread::sleep_until(std::min(due, clock::now() + BACKUP_MAX_SLEEP));
+            }
+        }
+    }
+    if (ok && m_backupIncremental) {
+        uint32_t endMark = INVALID_PAGE;
+        ok = writeAll(outFd, reinterpret_cast<const uint8_t *>(&endMark), sizeof(endMark)) &&
+             writeAll(outFd, reinterpret_cast<const uint8_t *>(&checksum), sizeof(checksum));
+    }
+
+    std::lock_guard<std::mutex> lock(m_backupMutex);
+    m_backupOk = ok;
+    m_backupActive = false;
+    m_backupCopied.clear();
+    m_backupSaved.clear();
+}
+
+bool BPlusTree::restoreIncremental(const std::string &baseFile, int inFd) {
+    if (!fileExists(baseFile)) return false;
+    {
+        // settle anything left in the base's own journal
+        BPlusTree base(baseFile, 0, 0);
+        if (!base.isWritable()) return false;
+    }
+    IncrementalHeader hdr{};
+    if (!readAll(inFd, &hdr, sizeof(hdr)) || hdr.magic != INCREMENTAL_MAGIC ||
+        hdr.pageSize != PAGE_SIZE || hdr.pageCount == 0) {
+        std::cerr << "Invalid incremental backup\n";
+        return false;
+    }
+
+    // Spool the pages as journal records into a temporary file and move it
+    // into place once complete, so the base's journal holds all of them or
+    // none. Records are capped at the checkpoint size to bound memory. A
+    // last record truncates the base to the source's size, dropping pages
+    // a rebuild or resize of the source left behind.
+    const std::string walName = baseFile + ".wal";
+    const std::string tmpName = walName + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return false;
+    }
+    const size_t recordBytes = JOURNAL_CHECKPOINT_BYTES / JOURNAL_ENTRY_SIZE * JOURNAL_ENTRY_SIZE;
+    std::vector<uint8_t> rec(sizeof(JournalRecord));
+    auto writeRecord = [&]() {
+        size_t size = rec.size() - sizeof(JournalRecord);
+        if (size == 0) return true;
+        JournalRecord jr{JOURNAL_MAGIC, static_cast<uint32_t>(size / JOURNAL_ENTRY_SIZE),
+                         journalChecksum(rec.data() + sizeof(JournalRecord), size)};
+        std::memcpy(rec.data(), &jr, sizeof(jr));
+        bool done = writeAll(fd, rec.data(), rec.size());
+        rec.resize(sizeof(JournalRecord));
+        return done;
+    };
+
+    uint64_t checksum = journalChecksum(nullptr, 0);
+    bool haveHeader = false;
+    bool ok = true;
+    while (ok) {
+        uint32_t pageId = 0;
+        ok = readAll(inFd, &pageId, sizeof(pageId));
+        if (!ok || pageId == INVALID_PAGE) break;
+        size_t at = rec.size();
+        rec.resize(at + JOURNAL_ENTRY_SIZE);
+        std::memcpy(rec.data() + at, &pageId, sizeof(pageId));
+        ok = readAll(inFd, rec.data() + at + sizeof(pageId), PAGE_SIZE);
+        checksum = journalChecksum(rec.data() + at, JOURNAL_ENTRY_SIZE, checksum);
+        haveHeader = haveHeader || pageId == 0;
+        if (ok && rec.size() - sizeof(JournalRecord) >= recordBytes) ok = writeRecord();
+    }
+    uint64_t expected = 0;
+    JournalRecord truncate{JOURNAL_TRUNCATE_MAGIC, hdr.pageCount,
+                           journalChecksum(reinterpret_cast<const uint8_t *>(&hdr.pageCount),
+                                           sizeof(hdr.pageCount))};
+    ok = ok && haveHeader && readAll(inFd, &expected, sizeof(expected)) && expected == checksum &&
+         writeRecord() && writeAll(fd, reinterpret_cast<const uint8_t *>(&truncate), sizeof(truncate)) &&
+         ::fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok) {
+        std::cerr << "Incomplete or corrupt incremental backup\n";
+        ::unlink(tmpName.c_str());
+        return false;
+    }
+    if (::rename(tmpName.c_str(), walName.c_str()) != 0) {
+        perror("rename");
+        ::unlink(tmpName.c_str());
+        return false;
+    }
+    // opening the base replays the journal and rebuilds its secondary indexes
+    BPlusTree base(baseFile, 0, 0);
+    return base.isWritable();
+}
+
+bool BPlusTree::readChangeLogHeader(int fd, ChangeLogHeader &hdr) {
+    if (::pread(fd, &hdr, sizeof(hdr), 0) == static_cast<ssize_t>(sizeof(hdr)) &&
+        hdr.magic == CHANGE_LOG_MAGIC && hdr.recordSize == sizeof(ChangeRecord)) {
+        return true;
+    }
+    std::cerr << "Invalid change log\n";
+    return false;
+}
+
+bool BPlusTree::validChange(const ChangeRecord &rec) {
+    return rec.checksum == crc32c(&rec, offsetof(ChangeRecord, checksum));
+}
+
+bool BPlusTree::enableChangeLog(const std::string &logFile) {
+    if (!isWritable()) return false;
+    closeChangeLog();
+    int fd = ::open(logFile.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open");
+        return false;
+    }
+    // kept in the header so the log is reopened with the file
+    char storedPath[CHANGE_LOG_PATH_MAX] = {};
+    char *path = ::realpath(logFile.c_str(), nullptr);
+    if (!path || std::strlen(path) >= CHANGE_LOG_PATH_MAX) {
+        std::cerr << "Invalid change log path: " << logFile << "\n";
+        std::free(path);
+        ::close(fd);
+        return false;
+    }
+    std::memcpy(storedPath, path, std::strlen(path));
+    std::free(path);
+    off_t size = lseek(fd, 0, SEEK_END);
+    ChangeLogHeader hdr{CHANGE_LOG_MAGIC, sizeof(ChangeRecord), m_header.changeSeq + 1};
+    bool ok = size >= 0;
+    if (ok && size == 0) {
+        ok = writeAll(fd, reinterpret_cast<const uint8_t *>(&hdr), sizeof(hdr));
+    } else if (ok) {
+        ok = readChangeLogHeader(fd, hdr);
+        // the log numbers the changes: continue after its last complete one,
+        // dropping a record torn by a crash
+        uint64_t count = ok ? (static_cast<uint64_t>(size) - sizeof(hdr)) / sizeof(ChangeRecord) : 0;
+        while (ok && count > 0) {
+            ChangeRecord rec{};
+            ok = ::pread(fd, &rec, sizeof(rec),
+                         static_cast<off_t>(sizeof(hdr) + (count - 1) * sizeof(rec))) ==
+                 static_cast<ssize_t>(sizeof(rec));
+            if (ok && validChange(rec)) break;
+            --count;
+        }
+        ok = ok && ::ftruncate(fd, static_cast<off_t>(sizeof(hdr) + count * sizeof(ChangeRecord))) == 0;
+        m_header.changeSeq = hdr.firstSeq + count - 1;
+    }
+    if (ok) {
+        m_header.flags |= FILE_FLAG_CHANGE_LOG;
+        std::memcpy(m_header.changeLogPath, storedPath, sizeof(storedPath));
+    }
+    if (!ok || !flushHeader()) {
+        ::close(fd);
+        return false;
+    }
+    m_changeFd = fd;
+    m_changeLogFile = logFile;
+    return true;
+}
+
+void BPlusTree::disableChangeLog() {
+    closeChangeLog();
+    if (!(m_header.flags & (FILE_FLAG_CHANGE_LOG | FILE_FLAG_CHANGE_LOG_BROKEN))) return;
+    m_header.flags &= ~(FILE_FLAG_CHANGE_LOG | FILE_FLAG_CHANGE_LOG_BROKEN);
+    std::memset(m_header.changeLogPath, 0, sizeof(m_header.changeLogPath));
+    if (isWritable()) flushHeader();
+}
+
+void BPlusTree::closeChangeLog() {
+    if (m_changeFd >= 0) {
+        ::close(m_changeFd);
+        m_changeFd = -1;
+    }
+}
+
+bool BPlusTree::resetChangeLog() {
+    if (m_changeFd < 0) return false;
+    // replace the file whole so a replica reading it never sees it empty
+    std::string tmpName = m_changeLogFile + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("open");
+        return false;
+    }
+    ChangeLogHeader hdr{CHANGE_LOG_MAGIC, sizeof(ChangeRecord), m_header.changeSeq + 1};
+    if (!writeAll(fd, reinterpret_cast<const uint8_t *>(&hdr), sizeof(hdr)) ||
+        ::rename(tmpName.c_str(), m_changeLogFile.c_str()) != 0) {
+        ::close(fd);
+        ::unlink(tmpName.c_str());
+        return false;
+    }
+    ::close(m_changeFd);
+    m_changeFd = fd;
+    // the log is consistent again
+    m_header.flags &= ~FILE_FLAG_CHANGE_LOG_BROKEN;
+    return flushHeader();
+}
+
+bool BPlusTree::logChanges(const WriteBatch::Op *const *ops, size_t count) {
+    if (m_changeFd < 0 || count == 0) return true;
+    const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count();
+    std::vector<ChangeRecord> recs(count);
+    for (size_t i = 0; i < count; ++i) {
+        ChangeRecord &r = recs[i];
+        r.seq = ++m_header.changeSeq;
+        r.timeNs = now;
+        r.key = ops[i]->key;
+        r.remove = ops[i]->remove ? 1 : 0;
+        r.last = i + 1 == count ? 1 : 0;
+        if (!ops[i]->remove) std::memcpy(r.value, ops[i]->value.data(), VALUE_SIZE);
+        r.checksum = crc32c(&r, offsetof(ChangeRecord, checksum));
+    }
+    if (!writeAll(m_changeFd, reinterpret_cast<const uint8_t *>(recs.data()),
+                  recs.size() * sizeof(ChangeRecord))) {
+        // the log no longer matches the tree: refuse writes, even after a
+        // reopen, until it is reset
+        std::cerr << "Change log write failed, refusing writes until resetChangeLog\n";
+        m_header.flags |= FILE_FLAG_CHANGE_LOG_BROKEN;
+        flushHeader();
+        return false;
+    }
+    return true;
+}
+
+bool BPlusTree::applyChangeLog(const std::string &logFile, size_t maxChanges) {
+    if (!isWritable()) return false;
+    int fd = ::open(logFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return false;
+    }
+    ChangeLogHeader hdr{};
+    bool ok = readChangeLogHeader(fd, hdr);
+    if (ok && m_header.changeSeq + 1 < hdr.firstSeq) {
+        std::cerr << "Replica is behind the start of the change log\n";
+        ok = false;
+    }
+
+    std::vector<ChangeRecord> recs(CHANGE_APPLY_RECORDS);
+    size_t applied = 0;
+    while (ok && (maxChanges == 0 || applied < maxChanges)) {
+        const uint64_t next = m_header.changeSeq + 1;
+        ssize_t n = ::pread(fd, recs.data(), recs.size() * sizeof(ChangeRecord),
+                            static_cast<off_t>(sizeof(hdr) + (next - hdr.firstSeq) * sizeof(ChangeRecord)));
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        // whole writes only: stop at the last record ending one
+        size_t count = static_cast<size_t>(n) / sizeof(ChangeRecord);
+        WriteBatch batch;
+        size_t valid = 0;
+        size_t complete = 0;
+        uint64_t lastSeq = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const ChangeRecord &r = recs[i];
+            if (r.seq != next + i || !validChange(r)) break; // still being written
+            ++valid;
+            if (r.remove) {
+                batch.remove(r.key);
+            } else {
+                batch.put(r.key, r.value);
+            }
+            if (r.last) {
+                complete = batch.ops.size();
+                lastSeq = r.seq;
+                if (maxChanges != 0 && applied + complete >= maxChanges) break;
+            }
+        }
+        if (complete == 0) {
+            if (valid + 1 < count) {
+                // only the last record can be incomplete; one followed by
+                // others is damaged and nothing after it can be applied
+                std::cerr << "Corrupt change log record " << next + valid << "\n";
+                ok = false;
+            } else if (valid == recs.size()) {
+                // a leader batch larger than the window: read more at once
+                recs.resize(recs.size() * 2);
+                continue;
+            }
+            break;
+        }
+        batch.ops.resize(complete);
+        ok = writeBatchAt(batch, lastSeq);
+        applied += complete;
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool BPlusTree::replicaLag(const std::string &logFile, ReplicaLag &lag) {
+    if (!isOk()) return false;
+    int fd = ::open(logFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return false;
+    }
+    ChangeLogHeader hdr{};
+    off_t size = lseek(fd, 0, SEEK_END);
+    bool ok = size >= 0 && readChangeLogHeader(fd, hdr);
+    if (ok) {
+        uint64_t count = (static_cast<uint64_t>(size) - sizeof(hdr)) / sizeof(ChangeRecord);
+        lag.appliedSeq = m_header.changeSeq;
+        lag.logSeq = hdr.firstSeq + count - 1;
+        lag.pendingChanges = lag.logSeq > lag.appliedSeq ? lag.logSeq - lag.appliedSeq : 0;
+        lag.pendingBytes = lag.pendingChanges * sizeof(ChangeRecord);
+        lag.secondsBehind = 0;
+        if (lag.pendingChanges != 0) {
+            // the oldest change still in the log that this replica lacks
+            uint64_t oldest = std::max(lag.appliedSeq + 1, hdr.firstSeq);
+            ChangeRecord rec{};
+            if (::pread(fd, &rec, sizeof(rec),
+                        static_cast<off_t>(sizeof(hdr) + (oldest - hdr.firstSeq) * sizeof(rec))) ==
+                    static_cast<ssize_t>(sizeof(rec)) &&
+                validChange(rec)) {
+                int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  std::chrono::system_clock::now().time_since_epoch()).count();
+                lag.secondsBehind = std::max<int64_t>(0, now - rec.timeNs) / 1e9;
+            }
+        }
+    }
+    ::close(fd);
+    return ok;
+}
@@ -4,17 +4,104 @@
 #ifndef BPLUSTREE_H
 #define BPLUSTREE_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "aggregate.h"
+#include "art.h"
+#include "crc32c.h"
+#include "pagecache.h"
+#include "secindex.h"
+
 static constexpr uint32_t PAGE_SIZE = 4096;
 static constexpr uint32_t VALUE_SIZE = 100;
 
+// Maximum number of value fields with zone maps (see setZoneMapFields)
+static constexpr uint32_t ZONE_MAX_FIELDS = 2;
+// Maximum number of value fields with secondary indexes (see createIndex)
+static constexpr uint32_t INDEX_MAX_FIELDS = 4;
+
+// Default page cache size: 4096 pages = 16 MiB
+static constexpr size_t DEFAULT_CACHE_PAGES = 4096;
+// Default record cache size: 16384 values = 1.6 MiB
+static constexpr size_t DEFAULT_CACHE_RECORDS = 16384;
+
+// A key together with its value
+struct Record {
+    int32_t key;
+    std::array<uint8_t, VALUE_SIZE> value;
+};
+
+// Caller-owned columnar output for BPlusTree::scanBatch
+struct ColumnBatch {
+    int32_t *keys;     // capacity entries
+    uint8_t *values;   // capacity * VALUE_SIZE bytes, or nullptr for keys only
+    size_t capacity;
+    size_t count;      // rows filled by the last scanBatch
+};
+
+// Writes and deletes applied all-or-nothing by BPlusTree::writeBatch.
+// Later operations on the same key replace earlier ones.
+struct WriteBatch {
+    struct Op {
+        int32_t key;
+        bool remove;
+        std::array<uint8_t, VALUE_SIZE> value;
+    };
+    std::vector<Op> ops;
+
+    void put(int32_t key, const uint8_t data[VALUE_SIZE]);
+    void remove(int32_t key);
+    void clear() { ops.clear(); }
+};
+
+// How far a replica is behind the change log it follows
+struct ReplicaLag {
+    uint64_t appliedSeq;     // last change applied to the replica
+    uint64_t logSeq;         // last change written to the log
+    uint64_t pendingChanges; // logSeq - appliedSeq
+    uint64_t pendingBytes;   // log bytes not applied yet
+    double secondsBehind;    // age of the oldest change not applied yet (0 when caught up)
+};
+
+// How BPlusTree::merge applies the other tree
+enum class MergeStrategy : uint8_t {
+    AUTO,     // pick the cheaper of the two from the trees' shapes
+    IN_PLACE, // rewrite only the leaves the incoming records fall into
+    REBUILD   // write a new, densely packed file from both trees and swap it in
+};
+
+// Position of a columnar range scan
+struct ScanCursor {
+    int32_t nextKey;
+    int32_t upperKey;
+    bool done;
+    bool failed; // I/O error, as opposed to reaching the end
+};
+
 // Public API wrapper around the on-disk B+ tree
 class BPlusTree {
 public:
-    explicit BPlusTree(const std::string &filename);
+    // cachePages: capacity of the in-memory page cache (0 disables caching).
+    // At open, pages listed in "<filename>.warm" are prefetched into the
+    // cache in the background.
+    // cacheRecords: capacity of the key -> value cache consulted by readData
+    // before any page is touched (0 disables it).
+    explicit BPlusTree(const std::string &filename,
+                       size_t cachePages = DEFAULT_CACHE_PAGES,
+                       size_t cacheRecords = DEFAULT_CACHE_RECORDS);
     ~BPlusTree();
 
     // disable copy
@@ -25,6 +112,18 @@ public:
     bool writeData(int32_t key, const uint8_t data[VALUE_SIZE]);
     bool deleteData(int32_t key);
 
+    // Atomic write batch
+    // Applies every operation of the batch or none of them, even across a
+    // crash. The batch is applied in memory with one descent per affected
+    // leaf, then the resulting page images are appended to "<filename>.wal"
+    // and synced once (the commit point) before being written in place.
+    // The journal is replayed at open and emptied (after syncing the index
+    // file) before the next write outside a batch. Deleting an absent key
+    // is not an error. Returns false if nothing was applied, or if the
+    // batch was committed but could not be written in place: the tree
+    // then refuses all further calls, and reopening it replays the batch.
+    bool writeBatch(const WriteBatch &batch);
+
     // Reading API
     // Returns true and fills outData if found, false otherwise.
     bool readData(int32_t key, uint8_t outData[VALUE_SIZE]);
@@ -35,29 +134,360 @@ public:
                                                                int32_t upperKey,
                                                                int &n);
 
+    // Multi-range read
+    // Returns the records of every key in any of the given [lower, upper]
+    // ranges, in key order. Ranges are sorted and overlapping ones merged
+    // first. The scan only moves forward: a range starting in the leaf
+    // already loaded continues there, otherwise its first leaf is located
+    // through the internal nodes, so leaves between ranges are skipped and
+    // no leaf is read twice.
+    std::vector<Record> readRanges(std::vector<std::pair<int32_t, int32_t>> ranges);
+
+    // Merge join
+    // Calls fn(key, leftValue, rightValue) for every key present in both
+    // trees, in key order. The two leaf chains are walked together; when
+    // one side is behind, it seeks to the other side's key, within the
+    // current leaf if possible and otherwise by a descent, so runs of
+    // non-matching leaves are skipped. fn returns false to stop. Returns
+    // false on I/O error.
+    static bool mergeJoin(BPlusTree &left, BPlusTree &right,
+                          const std::function<bool(int32_t key, const uint8_t *leftValue,
+                                                   const uint8_t *rightValue)> &fn);
+
+    // Shared scans
+    // Calls fn(key, value) for every record in [lowerKey, upperKey]. Several
+    // threads may run shared scans at once (with no concurrent writer). A
+    // scan that starts while another one is inside its range attaches to
+    // it: it starts at that scan's current leaf, so both read the same
+    // leaves together and each is fetched from disk once, then wraps
+    // around to read the prefix it skipped. Records therefore arrive in key
+    // order from the attach point to upperKey, then from lowerKey up to the
+    // attach point. fn returns false to stop. Returns false on I/O error.
+    bool scanShared(int32_t lowerKey, int32_t upperKey,
+                    const std::function<bool(int32_t key, const uint8_t *value)> &fn);
+
+    // Columnar range scan
+    // openScan starts a scan of [lowerKey, upperKey]; each scanBatch call
+    // then fills up to batch.capacity rows into the caller's key and value
+    // arrays, copying whole runs straight out of the leaves. Returns false
+    // (with batch.count == 0) once the range is exhausted, or on I/O error,
+    // which also sets cursor.failed. The cursor holds a key, not a page, so
+    // the tree may be modified between batches.
+    ScanCursor openScan(int32_t lowerKey, int32_t upperKey) const;
+    bool scanBatch(ScanCursor &cursor, ColumnBatch &batch);
+
+    // Physical-order full scan
+    // Calls fn(key, value) for every record, visiting leaves in page-id
+    // (file) order rather than key order, so the file is read sequentially
+    // in large chunks. Leaf pages are recognised by their node type and by
+    // being referenced from an internal node. fn returns false to stop.
+    bool scanPhysical(const std::function<bool(int32_t key, const uint8_t *value)> &fn);
+
+    // Aggregate pushdown
+    // Computes count/sum/min/max of an integer field inside the values of
+    // all keys in [lowerKey, upperKey]. Values are aggregated in place in
+    // each leaf (SIMD where available) without being copied out. Returns
+    // false if the field does not fit inside a value or on I/O error.
+    bool aggregateRange(int32_t lowerKey, int32_t upperKey, const FieldDesc &field,
+                        AggregateResult &result);
+
+    // Zone maps
+    // Declares up to ZONE_MAX_FIELDS integer fields (at most 32 bits wide)
+    // whose min/max are kept for every child in internal nodes. Existing
+    // nodes are summarised immediately; afterwards writes widen the
+    // summaries (deletes leave them as conservative supersets). An empty
+    // list drops the zone maps. The declaration is stored in the file.
+    bool setZoneMapFields(const std::vector<FieldDesc> &fields);
+
+    // Fills records with the records with keys in [lowerKey, upperKey]
+    // whose field lies in [minValue, maxValue]. If the field has a zone
+    // map, subtrees and leaves whose summary cannot match are skipped
+    // without being read. Returns false on an invalid field or I/O error.
+    bool scanFiltered(int32_t lowerKey, int32_t upperKey, const FieldDesc &field,
+                      int64_t minValue, int64_t maxValue, std::vector<Record> &records);
+
+    // Secondary indexes
+    // createIndex builds an index on an integer field (at most 32 bits
+    // wide) in "<filename>.idx-<offset>-<type>": a second B+ tree keyed by
+    // (field value, primary key). Once created, writeData and deleteData
+    // keep it up to date and it is reopened with the tree; it is rebuilt
+    // if its file is missing or invalid, or the tree was not closed
+    // cleanly. dropIndex deletes it.
+    bool createIndex(const FieldDesc &field);
+    bool dropIndex(const FieldDesc &field);
+
+    // Index-only lookup: the (field value, key) pairs of the records whose
+    // field lies in [minValue, maxValue], ordered by value then key, read
+    // from the index alone. Returns false if the field has no index.
+    bool lookupKeysByField(const FieldDesc &field, int64_t minValue, int64_t maxValue,
+                           std::vector<std::pair<int64_t, int32_t>> &entries);
+    // Lookup-back: the matching records, in key order. The keys found in
+    // the index are sorted and fetched in one forward pass over the tree;
+    // records whose field no longer matches (stale entries) are skipped.
+    bool lookupByField(const FieldDesc &field, int64_t minValue, int64_t maxValue,
+                       std::vector<Record> &records);
+
+    // Merging
+    // Adds every record of 'delta' to this tree, replacing existing values.
+    // IN_PLACE walks delta in key order and applies it through write
+    // batches, one descent and one rewrite per affected leaf. REBUILD
+    // merges both leaf chains into a new file with nodes 90% full, replaces
+    // the index file with it (rename) and rebuilds the secondary indexes.
+    // AUTO estimates from the internal nodes how many leaves an in-place
+    // merge would touch and rebuilds when that costs more than rewriting
+    // everything sequentially. Either way a crash leaves a consistent tree;
+    // an in-place merge may then have applied part of delta.
+    bool merge(BPlusTree &delta, MergeStrategy strategy = MergeStrategy::AUTO);
+
+    // Subtree hashes
+    // setSubtreeHashes(true) stores in every internal node a 32-bit hash of
+    // each child's subtree: the sum of a hash of each (key, value) below
+    // it, so it depends on the contents only, not on the tree's shape.
+    // Writes update the hashes along the path they modify. The setting is
+    // stored in the file; frozen copies always carry hashes.
+    bool setSubtreeHashes(bool enabled);
+
+    // Calls fn(key, leftValue, rightValue) for every key whose record
+    // differs between the trees, in key order; a value is nullptr where the
+    // key is absent. When both trees have hashes, the descent pairs up the
+    // children covering the same key range and skips those whose hashes
+    // agree, so copies sharing most of their structure (a backup and its
+    // source, a replica) compare in time proportional to the difference.
+    // fn returns false to stop. Returns false on I/O error.
+    static bool diff(BPlusTree &left, BPlusTree &right,
+                     const std::function<bool(int32_t key, const uint8_t *leftValue,
+                                              const uint8_t *rightValue)> &fn);
+
+    // Random sampling
+    // Returns k records drawn uniformly at random (with replacement). Each
+    // draw is one root-to-leaf descent that picks a child slot uniformly out
+    // of the maximum fanout and restarts when the slot is unused, so every
+    // record is equally likely whatever the node fill. Expected cost is
+    // O(k * height) page reads. seed = 0 picks a random seed. Fewer than k
+    // records are returned only if the tree is (nearly) empty.
+    std::vector<Record> sampleRecords(size_t k, uint64_t seed = 0);
+
+    // Range cardinality estimation
+    // Approximate number of keys in [lowerKey, upperKey], answered from an
+    // equi-depth histogram whose bucket bounds are the separators found in
+    // internal nodes. The histogram is built on first use and rebuilt after
+    // enough writes and deletes; each build also reads about 32 sampled
+    // leaves to size the buckets. Other calls read no page at all.
+    uint64_t estimateRange(int32_t lowerKey, int32_t upperKey);
+
+    // Frozen indexes
+    // Writes a read-optimized copy of the tree to targetFile: leaves 100%
+    // full and stored contiguously in key order, followed by each internal
+    // level bottom-up, its children spread evenly over the fewest nodes
+    // that hold them. The copy is immutable; opening it maps the file
+    // read-only and all writes fail.
+    bool freeze(const std::string &targetFile);
+    bool isReadOnly() const { return m_readOnly; }
+
+    // Cloning
+    // Copies the index file and its secondary index files to targetFile
+    // (and targetFile's index names), after writing out the header and
+    // checkpointing the batch journal. Where the file system supports
+    // reflinks (FICLONE: Btrfs, XFS, ...) the copy shares the source's
+    // blocks and is near instant. Otherwise 'threads' workers (0 = one per
+    // core) copy chunks of the file with copy_file_range, or read/write
+    // where that is unsupported. The copy opens as a cleanly closed file.
+    // Must not run alongside writes.
+    bool clone(const std::string &targetFile, unsigned threads = 0);
+
+    // Resharding
+    // Writes the records with keys below 'key' to leftFile and the rest to
+    // rightFile, as two independent index files; this tree is unchanged.
+    // Leaf pages and the subtrees off the root-to-boundary path are copied
+    // as they are, only renumbered so each file is compact. Just the
+    // boundary leaf and the path above it are rebuilt: a remainder shorter
+    // than its neighbours is hung onto the near edge of the adjacent
+    // subtree so every leaf stays at the same depth. Secondary indexes are
+    // built for both files. On failure neither file is left behind.
+    bool split(int32_t key, const std::string &leftFile, const std::string &rightFile);
+
+    // Page checksums
+    // New files stamp a CRC-32C into every node page and verify it when the
+    // page is read from disk. setPageChecksums(false) stops both;
+    // setPageChecksums(true) stamps every page of the file, which also
+    // upgrades files written before checksums existed.
+    bool setPageChecksums(bool enabled);
+
+    // Integrity check
+    // Verifies the whole file: page checksums, key order inside every node,
+    // keys within the separator bounds given by the parent, all leaves at
+    // the same depth, the leaf chain visiting the leaves in key order, and
+    // every page referenced exactly once, by the tree or the free list.
+    // Subtrees below the top levels are checked by 'threads' workers (0 =
+    // one per core) reading the file directly, not through the cache. Must
+    // not run alongside writes. Problems are appended to errors if given;
+    // returns true if none. The check also runs at open if the file was
+    // not closed cleanly; pages a crash left unreachable are then put on
+    // the free list, and only other problems open the file read-only.
+    bool checkIntegrity(unsigned threads = 0, std::vector<std::string> *errors = nullptr);
+
+    // Online backup
+    // startBackup streams an image of the file as of the call to outFd
+    // from a background thread, at most bytesPerSecond (0 = unlimited),
+    // while reads and writes go on. A page about to be overwritten before
+    // the backup has copied it is saved in memory first (copy on write),
+    // so the image is consistent; it opens as a cleanly closed file.
+    // Secondary indexes are not included (they are rebuilt on open).
+    // One backup at a time; the caller owns outFd and should sync it.
+    // finishBackup waits for the backup and returns true if the whole image
+    // was written. A backup still running at destruction is abandoned.
+    bool startBackup(int outFd, uint64_t bytesPerSecond = 0);
+    bool finishBackup();
+    bool backupDone() const { return !m_backupActive.load(); }
+
+    // Incremental backups
+    // Every page write stamps the page with a log sequence number (LSN),
+    // increasing across restarts. lastLsn() is the highest one handed out;
+    // read it when starting a backup to know what the backup contains.
+    // startIncrementalBackup works like startBackup but streams only the
+    // pages whose LSN is above sinceLsn (plus the file header), as of the
+    // call. restoreIncremental applies such a stream onto a closed copy of
+    // the file; incrementals must be applied in order onto the backup they
+    // were taken against. The pages are journaled first, so a crash during
+    // the restore leaves either the old or the new contents.
+    uint64_t lastLsn() const { return m_nextLsn - 1; }
+    bool startIncrementalBackup(int outFd, uint64_t sinceLsn, uint64_t bytesPerSecond = 0);
+    static bool restoreIncremental(const std::string &baseFile, int inFd);
+
+    // Change log and read replicas
+    // enableChangeLog makes writeData, deleteData and writeBatch append
+    // every change they make to logFile, numbered by a sequence number
+    // that continues across reopens. A replica is a copy of the file taken
+    // with startBackup (or restored from backups); the copy records the
+    // last change it contains.
+    // applyChangeLog, called on the replica, applies the complete changes
+    // logged since then, grouping many leader writes into one atomic batch
+    // (leader batches are never split). Call it periodically, between reads
+    // of the replica; nothing else may write to a replica. resetChangeLog
+    // empties the log; replicas that had not applied it all must be seeded
+    // again. The log is not synced: after a leader crash, reseed replicas.
+    // The log's path is kept in the file header, and opening the file
+    // reopens the log; if that fails the file is opened read-only. If an
+    // append to the log fails, the change is applied but the write returns
+    // false, and every later write is refused (changeLogBroken() is true,
+    // also after a reopen) until resetChangeLog or disableChangeLog.
+    bool enableChangeLog(const std::string &logFile);
+    void disableChangeLog();
+    bool resetChangeLog();
+    bool changeLogBroken() const { return (m_header.flags & FILE_FLAG_CHANGE_LOG_BROKEN) != 0; }
+    // maxChanges = 0 applies everything available. Returns false on I/O
+    // error, when the replica is behind the start of the log, or at a
+    // damaged record (the changes before it are applied).
+    bool applyChangeLog(const std::string &logFile, size_t maxChanges = 0);
+    bool replicaLag(const std::string &logFile, ReplicaLag &lag);
+
+    // Cache warm-up
+    // Writes the ids of the currently cached pages to "<filename>.warm".
+    // Also done at clean shutdown and periodically by a background thread.
+    bool saveHotPages();
+    // True once the background prefetch started at open has finished.
+    bool warmupDone() const { return m_warmDone.load(); }
+
+    // Radix index over the upper levels
+    // Builds an in-memory adaptive radix tree mapping key ranges to the
+    // nodes 'level' levels above the leaves (0 = the leaves themselves).
+    // Point reads, deletes and range scans then start their descent there
+    // instead of at the root. The index is kept up to date on splits.
+    bool enableRadixIndex(uint32_t level = 1);
+    void disableRadixIndex();
+
 private:
     int m_fd;
     std::string m_filename;
     bool m_ok;
+    bool m_readOnly;
+    const uint8_t *m_map; // whole file, for frozen indexes
+    size_t m_mapSize;
+    std::unique_ptr<std::atomic<bool>[]> m_mapVerified; // mapped pages whose checksum was checked
+
+    // write batch journal
+    int m_walFd;
+    uint64_t m_walSize;  // bytes of committed records not yet checkpointed
+    bool m_batchActive;  // page writes go to m_batchPages instead of the file
+    std::map<uint32_t, std::array<uint8_t, PAGE_SIZE>> m_batchPages;
+    uint32_t m_batchNextPage;
+
+    PageCache m_cache;
+    // hot records for readData, keyed by the key's bit pattern; holds
+    // VALUE_SIZE-byte values in the same LRU structure as the page cache
+    PageCache m_recordCache;
+    std::thread m_warmThread;
+    std::atomic<bool> m_warmStop;
+    std::atomic<bool> m_warmDone;
+    // periodic hot page list saves, off the read and write paths
+    std::thread m_hotSaveThread;
+    std::mutex m_hotSaveMutex; // also serializes writes of the .warm file
+    std::condition_variable m_hotSaveCv;
+    bool m_hotSaveStop;
+
+    // online backup
+    std::thread m_backupThread;
+    std::atomic<bool> m_backupActive;
+    std::atomic<bool> m_backupStop;
+    bool m_backupOk;
+    bool m_backupIncremental;      // stream (page id, page) entries, not an image
+    uint64_t m_backupSinceLsn;     // incremental: pages with a higher LSN
+    uint64_t m_backupEndLsn;       // lastLsn() when the backup started
+    uint64_t m_backupChangeSeq;    // change-log position when the backup started
+    std::mutex m_backupMutex;      // guards the fields below
+    uint32_t m_backupPages;        // pages in the snapshot
+    std::vector<bool> m_backupCopied;
+    // snapshot images of pages overwritten before the backup reached them
+    std::unordered_map<uint32_t, std::array<uint8_t, PAGE_SIZE>> m_backupSaved;
+
+    uint64_t m_nextLsn; // LSN stamped on the next page write
+
+    // change log written by this tree, -1 if disabled
+    int m_changeFd;
+    std::string m_changeLogFile;
+
+    uint32_t m_height; // number of levels, 1 = root is a leaf
+    AdaptiveRadixTree m_radix;
+    bool m_radixEnabled;
+    uint32_t m_radixLevel;
 
     // --- On-disk structures ---
 
+    // bytes of the change log path kept in the file header, terminator included
+    static constexpr size_t CHANGE_LOG_PATH_MAX = 1024;
+
     struct FileHeader {
         uint32_t magic;        // magic number to identify file
         uint32_t pageSize;     // should be 4096
         uint32_t rootPage;     // page id of root node
         uint32_t freeListHead; // first free page id or 0xFFFFFFFF if none
+        uint32_t flags;        // FILE_FLAG_* bits (0 in files from older versions)
+        uint32_t zoneFieldCount;                // fields with zone maps
+        FieldDesc zoneFields[ZONE_MAX_FIELDS];
+        uint32_t indexFieldCount;               // fields with secondary indexes
+        FieldDesc indexFields[INDEX_MAX_FIELDS];
+        uint64_t lsnLimit;     // no page carries an LSN at or above this
+        uint64_t changeSeq;    // last change-log sequence number applied or logged
+        char changeLogPath[CHANGE_LOG_PATH_MAX]; // absolute path (FILE_FLAG_CHANGE_LOG)
     };
 
+    static constexpr uint32_t FILE_FLAG_FROZEN = 1u; // produced by freeze(), read-only
+    static constexpr uint32_t FILE_FLAG_CHECKSUMS = 2u; // node pages carry a CRC-32C
+    static constexpr uint32_t FILE_FLAG_OPEN = 4u;      // set while open for writing
+    static constexpr uint32_t FILE_FLAG_HASHES = 8u;    // internal nodes carry subtree hashes
+    static constexpr uint32_t FILE_FLAG_CHANGE_LOG = 16u; // writes are logged to changeLogPath
+    static constexpr uint32_t FILE_FLAG_CHANGE_LOG_BROKEN = 32u; // an append to the log failed
+
     enum class NodeType : uint8_t {
         INTERNAL = 0,
-        LEAF = 1
+        LEAF = 1,
+        FREE = 2 // on the free list
     };
 
     struct NodeHeader {
         uint8_t type;       // NodeType
         uint32_t numKeys;   // number of valid keys
-        uint32_t reserved;  // padding / future use
+        uint32_t checksum;  // CRC-32C of the page with this field zeroed (FILE_FLAG_CHECKSUMS)
     };
 
     // Layout decisions:
@@ -72,10 +502,22 @@ private:
     static constexpr uint32_t INTERNAL_MAX_KEYS = 128;
     static constexpr uint32_t LEAF_MAX_KEYS = 39;
 
+    // Min/max of a zone-mapped field over a subtree. Values are stored
+    // order-preserving in 32 bits (UINT32 is shifted by 2^31); min > max
+    // marks a subtree with no values.
+    struct ZoneRange {
+        int32_t min;
+        int32_t max;
+    };
+
     struct InternalNode {
         NodeHeader hdr;
         int32_t keys[INTERNAL_MAX_KEYS];
         uint32_t children[INTERNAL_MAX_KEYS + 1];
+        // zone map of each child, for the first zoneFieldCount fields
+        ZoneRange zones[ZONE_MAX_FIELDS][INTERNAL_MAX_KEYS + 1];
+        // subtree hash of each child (FILE_FLAG_HASHES)
+        uint32_t hashes[INTERNAL_MAX_KEYS + 1];
     };
 
     struct LeafNode {
@@ -85,20 +527,315 @@ private:
         uint8_t values[LEAF_MAX_KEYS][VALUE_SIZE];
     };
 
+    // A page on the free list, which starts at FileHeader::freeListHead
+    struct FreePage {
+        NodeHeader hdr;
+        uint32_t nextFree; // page id of next free page or INVALID_PAGE
+    };
+
+    // Forward-only position in the leaf chain
+    struct LeafCursor {
+        LeafNode leaf;
+        uint32_t page = INVALID_PAGE;
+        uint32_t idx = 0;
+        bool failed = false; // I/O error, as opposed to reaching the end
+    };
+
+    static_assert(sizeof(InternalNode) <= PAGE_SIZE, "internal node must fit in a page");
+    static_assert(sizeof(LeafNode) <= PAGE_SIZE, "leaf node must fit in a page");
+    static_assert(sizeof(FileHeader) <= PAGE_SIZE, "file header must fit in a page");
+
+    // Every node page ends with the LSN of its last write (0 in pages
+    // written by older versions and in frozen copies)
+    static constexpr uint32_t PAGE_LSN_OFFSET = PAGE_SIZE - sizeof(uint64_t);
+    static_assert(sizeof(InternalNode) <= PAGE_LSN_OFFSET, "internal node overlaps the page LSN");
+    static_assert(sizeof(LeafNode) <= PAGE_LSN_OFFSET, "leaf node overlaps the page LSN");
+
+    // In-memory search copy of a cached internal node. Keys are stored in
+    // Eytzinger (BFS) order so a search walks one root-to-leaf path of an
+    // implicit binary tree whose top levels share cache lines; children stay
+    // in key order and are reached through rank[].
+    struct alignas(64) SearchNode {
+        int32_t keys[INTERNAL_MAX_KEYS + 1];       // 1-based, Eytzinger order
+        uint8_t rank[INTERNAL_MAX_KEYS + 1];       // Eytzinger slot -> key index
+        uint32_t children[INTERNAL_MAX_KEYS + 1];  // key order
+        uint32_t numKeys;
+
+        void build(const InternalNode &node);
+        uint32_t childFor(int32_t key) const;
+    };
+
+    // Equi-depth histogram of the key space
+    struct Histogram {
+        std::vector<int64_t> bounds; // bucket i covers keys [bounds[i], bounds[i + 1])
+        std::vector<double> counts;  // estimated keys per bucket
+        double total = 0;
+        bool valid = false;
+    };
+
     FileHeader m_header;
 
+    // search layouts of cached internal nodes, bounded by the page cache size
+    std::unordered_map<uint32_t, std::unique_ptr<SearchNode>> m_searchNodes;
+
+    // Main pass of a running scanShared, published for later scans to attach to
+    struct SharedScan {
+        int32_t upperKey;
+        std::atomic<int32_t> position; // lowest key of the leaf being read
+    };
+    std::mutex m_sharedScanMutex;
+    std::vector<SharedScan *> m_sharedScans;
+
+    // open secondary indexes, parallel to m_header.indexFields
+    std::vector<std::unique_ptr<SecondaryIndex>> m_indexes;
+
+    Histogram m_histogram;
+    uint64_t m_histogramMods; // writes and deletes since the histogram was built
+
     // low-level IO
     bool openFile(const std::string &filename);
     void closeFile();
     bool readPage(uint32_t pageId, void *page);
-    bool writePage(uint32_t pageId, const void *page);
+    bool writePage(uint32_t pageId, void *page); // stamps the checksum into page
     uint32_t allocatePage();
     void initEmptyTree();
     bool loadHeader();
     bool flushHeader();
+    bool mapFile();
+    bool writeFrozen(int outFd);
+    // Writes the records produced by next (in key order; returns false at
+    // the end) as a packed tree: leaves filled to fillPercent of their
+    // capacity, then each internal level likewise. hdr is written as the
+    // file header with rootPage filled in.
+    using RecordSource = std::function<bool(int32_t &key, uint8_t *value)>;
+    bool writePacked(int outFd, const RecordSource &next, FileHeader hdr, bool stampLsns,
+                     uint32_t fillPercent);
+
+    // cache warm-up helpers
+    std::string warmFileName() const { return m_filename + ".warm"; }
+    void startWarmup();
+    void stopWarmup();
+    void warmupWorker(std::vector<uint32_t> pages);
+    // True if a checksum mismatch seen by warm-up comes from a concurrent
+    // write rather than damage
+    bool warmPageChanged(uint32_t pageId, const uint8_t *page);
+    bool writeHotPages();
+    void startHotSaver();
+    void stopHotSaver();
+    void hotSaveWorker();
+
+    // radix index helpers
+    bool computeHeight();
+    // (lower bound key, page) of every node 'level' levels above the leaves,
+    // in key order; reads only the internal nodes above that level
+    bool collectLevel(uint32_t level, std::vector<std::pair<int32_t, uint32_t>> &out);
+    bool collectLevel(uint32_t page, uint32_t pageLevel, uint32_t level, int32_t lowerKey,
+                      std::vector<std::pair<int32_t, uint32_t>> &out);
+    void setRoot(uint32_t rootPage);
+    void noteSplit(uint32_t level, int32_t key, uint32_t rightPage);
+
+    // zone map helpers
+    // Filter for scanFiltered; zone < 0 when the field has no zone map
+    struct ScanFilter {
+        int32_t lowerKey;
+        int32_t upperKey;
+        FieldDesc field;
+        int zone;
+        int64_t minValue;
+        int64_t maxValue;
+    };
+
+    bool zonesEnabled() const { return m_header.zoneFieldCount != 0; }
+    int32_t zoneEncode(uint32_t f, const uint8_t value[VALUE_SIZE]) const;
+    int64_t zoneDecode(uint32_t f, int32_t stored) const;
+    void leafZones(const LeafNode &leaf, ZoneRange out[ZONE_MAX_FIELDS]) const;
+    void internalZones(const InternalNode &node, ZoneRange out[ZONE_MAX_FIELDS]) const;
+    bool nodeZones(uint32_t pageId, ZoneRange out[ZONE_MAX_FIELDS]);
+    bool setChildZones(InternalNode &node, uint32_t idx, uint32_t childPage);
+    bool widenZones(const std::vector<uint32_t> &path, const uint8_t value[VALUE_SIZE]);
+    bool rebuildZones(uint32_t pageId, ZoneRange out[ZONE_MAX_FIELDS]);
+    bool scanFilteredNode(uint32_t pageId, const ScanFilter &filter, std::vector<Record> &out);
+
+    // merge helpers
+    // Leaves an in-place merge is expected to rewrite: for each delta leaf,
+    // how many of the target leaves its key range overlaps its records hit
+    static double estimateMergeLeaves(const std::vector<std::pair<int32_t, uint32_t>> &leaves,
+                                      const std::vector<std::pair<int32_t, uint32_t>> &deltaLeaves,
+                                      const std::vector<uint32_t> &deltaCounts);
+    bool mergeInPlace(BPlusTree &delta);
+    bool mergeRebuild(BPlusTree &delta);
+
+    // split helpers
+    // A subtree of one side of a split: an unchanged subtree of this tree
+    // (page) or a node rebuilt in memory (node), with the zone map and hash
+    // its parent stores for it
+    struct SplitNode;
+    struct SplitRef {
+        uint32_t height = 0; // 0 = leaf
+        uint32_t page = INVALID_PAGE;
+        std::shared_ptr<SplitNode> node;
+        ZoneRange zones[ZONE_MAX_FIELDS] = {};
+        uint32_t hash = 0;
+    };
+    // Subtrees of equal height in key order, with the separators between them
+    struct SplitPart {
+        std::vector<SplitRef> refs;
+        std::vector<int32_t> seps;
+    };
+    struct SplitNode {
+        LeafNode leaf;                  // height 0
+        std::vector<int32_t> keys;      // internal nodes
+        std::vector<SplitRef> children;
+    };
+    // The records of the subtree at pageId on one side of key, as subtrees
+    // of at most the given height
+    bool splitSide(uint32_t pageId, uint32_t height, int32_t key, bool right, SplitPart &out);
+    // Joins part, lower than target, onto target's first or last edge
+    bool splitAttach(const SplitRef &target, const SplitPart &part, int32_t sep, bool atEnd,
+                     SplitPart &out);
+    static SplitPart splitJoin(SplitPart left, int32_t sep, SplitPart right);
+    // Groups the subtrees under new nodes of the given height (one unless
+    // they overflow a node); a single subtree is returned as it is
+    SplitPart splitNodes(uint32_t height, SplitPart part) const;
+    SplitRef splitRef(uint32_t height, const std::shared_ptr<SplitNode> &node) const;
+    void splitFill(const SplitNode &n, InternalNode &node) const;
+    bool writeSplit(const std::string &file, SplitPart part);
+
+    // subtree hash helpers
+    using DiffFn = std::function<bool(int32_t key, const uint8_t *leftValue,
+                                      const uint8_t *rightValue)>;
+    bool hashesEnabled() const { return (m_header.flags & FILE_FLAG_HASHES) != 0; }
+    static uint32_t recordHash(int32_t key, const uint8_t value[VALUE_SIZE]);
+    static uint32_t leafHash(const LeafNode &leaf);
+    static uint32_t internalHash(const InternalNode &node);
+    bool nodeHash(uint32_t pageId, uint32_t &hash);
+    bool setChildHash(InternalNode &node, uint32_t idx, uint32_t childPage);
+    // Recomputes the hash entries along a root-to-leaf path after the leaf changed
+    bool refreshHashes(const std::vector<uint32_t> &path);
+    bool rebuildHashes(uint32_t pageId, uint32_t &hash);
+    // Both subtrees cover the keys in [low, high)
+    static bool diffNodes(BPlusTree &left, uint32_t leftPage, BPlusTree &right, uint32_t rightPage,
+                          int64_t low, int64_t high, const DiffFn &fn, bool &stopped);
+    // Record-by-record comparison of the keys in [low, high)
+    static bool diffRange(BPlusTree &left, BPlusTree &right, int64_t low, int64_t high,
+                          const DiffFn &fn, bool &stopped);
+
+    // shared scan helpers
+    // Descent through readPage only, leaving the search node cache and the
+    // radix index alone, so concurrent scans may call it
+    uint32_t findLeafShared(int32_t key);
+    // Walks [lowerKey, upperKey]; publishes each leaf's position to 'self' if
+    // given. Sets 'stopped' when fn returns false.
+    bool sharedPass(int32_t lowerKey, int32_t upperKey, SharedScan *self,
+                    const std::function<bool(int32_t key, const uint8_t *value)> &fn,
+                    bool &stopped);
+
+    // write batch helpers
+    std::string walFileName() const { return m_filename + ".wal"; }
+    // Descends to the leaf for key; upperBound is the separator that ends
+    // the leaf's key range (INT64_MAX for the last leaf)
+    uint32_t findLeafBounded(int32_t key, std::vector<uint32_t> &path, int64_t &upperBound);
+    // ops sorted by key, one per key; oldValues[i] receives the value ops[i]
+    // replaced or removed (hadOld[i] is false if the key was absent)
+    bool applyBatch(const std::vector<const WriteBatch::Op *> &ops,
+                    std::vector<std::array<uint8_t, VALUE_SIZE>> &oldValues,
+                    std::vector<bool> &hadOld);
+    bool commitBatch();
+    void abortBatch(const FileHeader &savedHeader, uint32_t savedHeight);
+    bool checkpointJournal();
+    bool recoverJournal(bool &replayed);
+    // writeBatch that also sets the header's changeSeq when it is nonzero
+    bool writeBatchAt(const WriteBatch &batch, uint64_t changeSeq);
+
+    // change log helpers
+    // Log file: a ChangeLogHeader, then fixed-size records with consecutive
+    // sequence numbers starting at firstSeq
+    struct ChangeLogHeader {
+        uint32_t magic;
+        uint32_t recordSize;
+        uint64_t firstSeq;
+    };
+    struct ChangeRecord {
+        uint64_t seq;
+        int64_t timeNs;     // leader wall clock, ns since the epoch
+        int32_t key;
+        uint8_t remove;
+        uint8_t last;       // last change of its writeData / deleteData / writeBatch
+        uint8_t value[VALUE_SIZE];
+        uint32_t checksum;  // CRC-32C of the bytes before it
+    };
+    bool logChanges(const WriteBatch::Op *const *ops, size_t count);
+    void closeChangeLog();
+    static bool readChangeLogHeader(int fd, ChangeLogHeader &hdr);
+    static bool validChange(const ChangeRecord &rec);
+
+    // secondary index helpers
+    std::string indexFileName(const FieldDesc &field) const;
+    int findIndex(const FieldDesc &field) const;
+    bool openIndexes();
+    bool buildIndex(uint32_t i);
+    // (field value, key) packed so that index order is value order, then key order
+    static uint64_t indexKey(const FieldDesc &field, const uint8_t value[VALUE_SIZE], int32_t key);
+    // oldValue / newValue are nullptr when the key is absent before / after
+    bool updateIndexes(int32_t key, const uint8_t *oldValue, const uint8_t *newValue);
+
+    // cardinality estimation helpers
+    bool buildHistogram();
+
+    // integrity check helpers
+    // A subtree to check: its root page, key bounds [low, high) and depth
+    struct CheckTask {
+        uint32_t page;
+        int64_t low;
+        int64_t high;
+        uint32_t depth;
+    };
+    // What a worker found in one subtree
+    struct CheckResult {
+        std::vector<std::string> errors;
+        std::vector<uint32_t> pages;    // every page visited
+        uint32_t firstLeaf = INVALID_PAGE;
+        uint32_t lastLeaf = INVALID_PAGE;
+        uint32_t lastNext = INVALID_PAGE; // nextLeaf of lastLeaf
+    };
+    bool readPageDirect(uint32_t pageId, uint8_t *page);
+    // Checks one node; internal nodes append their children to 'children'
+    // (or recurse into them when children is nullptr)
+    void checkNode(const CheckTask &task, uint32_t pageCount, CheckResult &result,
+                   std::vector<CheckTask> *children);
+    // checkIntegrity that, when 'unreachable' is given, lists the pages
+    // nothing references there instead of reporting them as problems
+    bool checkFile(unsigned threads, std::vector<std::string> *errors,
+                   std::vector<uint32_t> *unreachable);
+    // Puts the pages on the free list
+    bool freePages(const std::vector<uint32_t> &pages);
+    bool setOpenFlag(bool open);
+
+    // online backup helpers
+    bool beginBackup(int outFd, uint64_t bytesPerSecond, bool incremental, uint64_t sinceLsn);
+    void backupWorker(int outFd, uint64_t bytesPerSecond);
+    void stopBackup();
+    // Called before pageId is overwritten in place: keeps its snapshot image
+    // if a running backup has not copied it yet
+    void preserveForBackup(uint32_t pageId);
+
+    // page checksums (node pages only; page 0 holds the file header)
+    bool checksumsEnabled() const { return (m_header.flags & FILE_FLAG_CHECKSUMS) != 0; }
+    static uint32_t pageChecksum(const uint8_t *page);
+    static void stampChecksum(uint8_t *page);
+    bool verifyPage(uint32_t pageId, const uint8_t *page) const;
+    // verifyPage without the error message
+    bool checksumMatches(uint32_t pageId, const uint8_t *page) const;
+
+    // page LSNs; LSNs are reserved in blocks recorded in the header, so
+    // numbers handed out before a crash are never reused
+    bool stampLsn(uint8_t *page);
+    bool reserveLsns();
+    static uint64_t pageLsn(const uint8_t *page);
 
     // helpers
     bool isOk() const { return m_ok; }
+    bool isWritable() const { return m_ok && !m_readOnly; }
 
     // tree navigation
     bool readInternal(uint32_t pageId, InternalNode &node);
@@ -107,6 +844,7 @@ private:
     bool writeLeaf(uint32_t pageId, const LeafNode &node);
 
     uint32_t findLeafPage(int32_t key, std::vector<uint32_t> *path = nullptr);
+    void cacheSearchNode(uint32_t pageId, const InternalNode &node);
 
     // insertion helpers
     bool insertInLeaf(uint32_t leafPage, int32_t key, const uint8_t value[VALUE_SIZE],
@@ -117,10 +855,19 @@ private:
                         uint32_t rightPage);
 
     // deletion helpers
-    bool deleteFromLeaf(uint32_t leafPage, int32_t key);
+    bool deleteFromLeaf(uint32_t leafPage, int32_t key, uint8_t *oldValue = nullptr);
+
+    // leaf cursor helpers; return false at the end of the tree or on error
+    bool cursorSeek(LeafCursor &c, int32_t key); // first key >= key, never moves back
+    bool cursorNext(LeafCursor &c);
+    bool cursorSettle(LeafCursor &c);
 
     // search helper
     bool searchInLeaf(const LeafNode &leaf, int32_t key, uint32_t &index) const;
+    static bool fieldFits(const FieldDesc &field) {
+        uint32_t width = fieldWidth(field.type);
+        return width != 0 && field.offset <= VALUE_SIZE - width;
+    }
 
     // utility
     static uint64_t pageOffset(uint32_t pageId) {
@@ -0,0 +1,239 @@
+// CRC-32C kernels
+
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_HAVE_SSE42_KERNEL 1
+#define CRC32C_HAVE_VPCLMUL_KERNEL 1
+#endif
+
+namespace {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78u; // reflected Castagnoli polynomial
+
+// table[k][b]: CRC of byte b followed by k zero bytes
+struct SliceTables {
+    uint32_t table[8][256];
+
+    SliceTables() {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t c = b;
+            for (int i = 0; i < 8; ++i) c = (c >> 1) ^ ((c & 1u) ? CRC32C_POLY : 0u);
+            table[0][b] = c;
+        }
+        for (uint32_t b = 0; b < 256; ++b) {
+            for (int k = 1; k < 8; ++k) {
+                uint32_t prev = table[k - 1][b];
+                table[k][b] = (prev >> 8) ^ table[0][prev & 0xFFu];
+            }
+        }
+    }
+};
+
+uint32_t crc32cTable(const uint8_t *p, size_t size, uint32_t crc) {
+    static const SliceTables tables;
+    const auto &t = tables.table;
+    while (size >= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, sizeof(w));
+        w ^= crc;
+        crc = t[7][w & 0xFF] ^ t[6][(w >> 8) & 0xFF] ^ t[5][(w >> 16) & 0xFF] ^
+              t[4][(w >> 24) & 0xFF] ^ t[3][(w >> 32) & 0xFF] ^ t[2][(w >> 40) & 0xFF] ^
+              t[1][(w >> 48) & 0xFF] ^ t[0][w >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFFu];
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42_KERNEL
+
+// The crc32 instruction has a latency of three cycles but can start every
+// cycle, so blocks are split into three lanes whose CRCs run in parallel
+// and are combined afterwards: crc(a || b) = shift(crc(a), |b|) ^ crc(b),
+// where shift appends |b| zero bytes. Shifting is linear in the CRC state,
+// so for the fixed lane length it is four table lookups.
+constexpr size_t CRC32C_LANE = 1360; // 3 lanes cover a page minus its header
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cZeros(uint32_t crc, size_t size) {
+    uint64_t c = crc;
+    for (size_t i = 0; i < size / 8; ++i) c = _mm_crc32_u64(c, 0);
+    return static_cast<uint32_t>(c);
+}
+
+struct LaneShiftTables {
+    uint32_t table[4][256];
+
+    LaneShiftTables() {
+        for (int k = 0; k < 4; ++k) {
+            for (uint32_t b = 0; b < 256; ++b) table[k][b] = crc32cZeros(b << (8 * k), CRC32C_LANE);
+        }
+    }
+
+    uint32_t shift(uint32_t crc) const {
+        return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^
+               table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+    }
+};
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(const uint8_t *p, size_t size, uint32_t crc) {
+    uint64_t c = crc;
+    if (size >= 3 * CRC32C_LANE) {
+        static const LaneShiftTables lanes;
+        while (size >= 3 * CRC32C_LANE) {
+            uint64_t c1 = 0, c2 = 0;
+            for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+                uint64_t w0, w1, w2;
+                std::memcpy(&w0, p + i, sizeof(w0));
+                std::memcpy(&w1, p + CRC32C_LANE + i, sizeof(w1));
+                std::memcpy(&w2, p + 2 * CRC32C_LANE + i, sizeof(w2));
+                c = _mm_crc32_u64(c, w0);
+                c1 = _mm_crc32_u64(c1, w1);
+                c2 = _mm_crc32_u64(c2, w2);
+            }
+            uint32_t merged = lanes.shift(static_cast<uint32_t>(c)) ^ static_cast<uint32_t>(c1);
+            c = lanes.shift(merged) ^ static_cast<uint32_t>(c2);
+            p += 3 * CRC32C_LANE;
+            size -= 3 * CRC32C_LANE;
+        }
+    }
+    while (size >= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        size -= 8;
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    while (size-- > 0) c32 = _mm_crc32_u8(c32, *p++);
+    return c32;
+}
+
+bool cpuHasSse42() {
+    static const bool has = __builtin_cpu_supports("sse4.2");
+    return has;
+}
+
+#endif // CRC32C_HAVE_SSE42_KERNEL
+
+#ifdef CRC32C_HAVE_VPCLMUL_KERNEL
+
+// Folding with carry-less multiplies. In the reflected bit order a 128-bit
+// block V = hi:lo stands for lo * x^64 + hi, and a block 'bits' further on
+// that contributes the same to the CRC is V * x^bits mod P:
+//   clmul(lo, x^(bits+63) mod P) ^ clmul(hi, x^(bits-1) mod P)
+// (a reflected clmul multiplies by an extra x). Four 512-bit accumulators
+// take 256 bytes per step; the last block is finished with crc32.
+constexpr uint32_t CRC32C_POLY_NORMAL = 0x1EDC6F41u;
+constexpr size_t CRC32C_FOLD_BYTES = 256;
+
+struct FoldConstants {
+    // lo/hi multipliers for moving a block 128, 256, 384, 512 and 2048 bits
+    uint64_t by128[2], by256[2], by384[2], by512[2], by2048[2];
+
+    // x^n mod P, reflected into the top half of a 64-bit clmul operand
+    static uint64_t xPow(uint32_t n) {
+        uint32_t r = 1;
+        for (uint32_t i = 0; i < n; ++i) r = (r << 1) ^ ((r & 0x80000000u) ? CRC32C_POLY_NORMAL : 0u);
+        uint32_t reflected = 0;
+        for (int b = 0; b < 32; ++b) reflected |= ((r >> b) & 1u) << (31 - b);
+        return static_cast<uint64_t>(reflected) << 32;
+    }
+
+    static void set(uint64_t k[2], uint32_t bits) {
+        k[0] = xPow(bits + 63);
+        k[1] = xPow(bits - 1);
+    }
+
+    FoldConstants() {
+        set(by128, 128);
+        set(by256, 256);
+        set(by384, 384);
+        set(by512, 512);
+        set(by2048, 8 * CRC32C_FOLD_BYTES);
+    }
+};
+
+__attribute__((target("avx512f")))
+inline __m512i broadcast(const uint64_t k[2]) {
+    const long long lo = static_cast<long long>(k[0]);
+    const long long hi = static_cast<long long>(k[1]);
+    return _mm512_set_epi64(hi, lo, hi, lo, hi, lo, hi, lo);
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul")))
+inline __m512i fold512(__m512i v, __m512i k, __m512i next) {
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(v, k, 0x00),
+                                     _mm512_clmulepi64_epi128(v, k, 0x11), next, 0x96);
+}
+
+__attribute__((target("pclmul")))
+inline __m128i fold128(__m128i v, const uint64_t k[2]) {
+    __m128i kk = _mm_set_epi64x(static_cast<long long>(k[1]), static_cast<long long>(k[0]));
+    return _mm_xor_si128(_mm_clmulepi64_si128(v, kk, 0x00), _mm_clmulepi64_si128(v, kk, 0x11));
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+uint32_t crc32cVpclmul(const uint8_t *p, size_t size, uint32_t crc) {
+    if (size < 2 * CRC32C_FOLD_BYTES) return crc32cSse42(p, size, crc);
+    static const FoldConstants f;
+
+    // the running CRC enters as if xored into the first four bytes
+    __m512i a0 = _mm512_xor_si512(_mm512_loadu_si512(p), _mm512_maskz_set1_epi32(1, static_cast<int>(crc)));
+    __m512i a1 = _mm512_loadu_si512(p + 64);
+    __m512i a2 = _mm512_loadu_si512(p + 128);
+    __m512i a3 = _mm512_loadu_si512(p + 192);
+    p += CRC32C_FOLD_BYTES;
+    size -= CRC32C_FOLD_BYTES;
+    const __m512i k = broadcast(f.by2048);
+    while (size >= CRC32C_FOLD_BYTES) {
+        a0 = fold512(a0, k, _mm512_loadu_si512(p));
+        a1 = fold512(a1, k, _mm512_loadu_si512(p + 64));
+        a2 = fold512(a2, k, _mm512_loadu_si512(p + 128));
+        a3 = fold512(a3, k, _mm512_loadu_si512(p + 192));
+        p += CRC32C_FOLD_BYTES;
+        size -= CRC32C_FOLD_BYTES;
+    }
+
+    // accumulators into the last one, then its lanes into the last lane
+    const __m512i k512 = broadcast(f.by512);
+    a1 = fold512(a0, k512, a1);
+    a2 = fold512(a1, k512, a2);
+    a3 = fold512(a2, k512, a3);
+    __m128i lanes[4];
+    _mm512_storeu_si512(lanes, a3);
+    __m128i v = _mm_xor_si128(lanes[3], fold128(lanes[0], f.by384));
+    v = _mm_xor_si128(v, _mm_xor_si128(fold128(lanes[1], f.by256), fold128(lanes[2], f.by128)));
+
+    uint64_t c = _mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(v)));
+    c = _mm_crc32_u64(c, static_cast<uint64_t>(_mm_extract_epi64(v, 1)));
+    return crc32cSse42(p, size, static_cast<uint32_t>(c));
+}
+
+bool cpuHasVpclmul() {
+    static const bool has = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq") &&
+                            __builtin_cpu_supports("sse4.2");
+    return has;
+}
+
+#endif // CRC32C_HAVE_VPCLMUL_KERNEL
+
+} // namespace
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+#ifdef CRC32C_HAVE_VPCLMUL_KERNEL
+    if (cpuHasVpclmul()) return ~crc32cVpclmul(p, size, crc);
+#endif
+#ifdef CRC32C_HAVE_SSE42_KERNEL
+    if (cpuHasSse42()) return ~crc32cSse42(p, size, crc);
+#endif
+    return ~crc32cTable(p, size, crc);
+}
@@ -0,0 +1,16 @@
+// CRC-32C (Castagnoli) checksums for page integrity.
+// Large buffers are folded 256 bytes per step with AVX-512 carry-less
+// multiplies (VPCLMULQDQ) when the CPU has them. Otherwise the SSE4.2 crc32
+// instruction is used, or a slicing-by-8 table lookup that consumes eight
+// bytes per step.
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Checksum of size bytes at data, continuing from crc (0 to start).
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+#endif // CRC32C_H
@@ -0,0 +1,107 @@
+// LRU page cache implementation
+
+#include "pagecache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+PageCache::PageCache(size_t capacityPages, size_t pageSize)
+    : m_capacity(capacityPages), m_pageSize(pageSize), m_tracking(false) {}
+
+bool PageCache::get(uint32_t pageId, void *out) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(pageId);
+    if (it == m_index.end()) return false;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    std::memcpy(out, it->second->data.data(), m_pageSize);
+    return true;
+}
+
+void PageCache::put(uint32_t pageId, const void *page) {
+    if (m_capacity == 0) return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_tracking) m_touched.insert(pageId);
+    insertLocked(pageId, page);
+}
+
+bool PageCache::putIfUntouched(uint32_t pageId, const void *page) {
+    if (m_capacity == 0) return false;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_index.count(pageId) != 0) return false;
+    if (m_tracking && m_touched.count(pageId) != 0) return false;
+    // Background inserts must not evict pages the foreground is using
+    if (m_lru.size() >= m_capacity) return false;
+    insertLocked(pageId, page);
+    return true;
+}
+
+void PageCache::beginTracking() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tracking = true;
+    m_touched.clear();
+}
+
+void PageCache::endTracking() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tracking = false;
+    m_touched.clear();
+}
+
+bool PageCache::touched(uint32_t pageId) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_tracking && m_touched.count(pageId) != 0;
+}
+
+void PageCache::erase(uint32_t pageId) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(pageId);
+    if (it == m_index.end()) return;
+    m_lru.erase(it->second);
+    m_index.erase(it);
+}
+
+void PageCache::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_lru.clear();
+    m_index.clear();
+}
+
+std::vector<uint32_t> PageCache::hotPages(size_t limit) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<uint32_t> ids;
+    ids.reserve(std::min(limit, m_lru.size()));
+    for (const Entry &e : m_lru) {
+        if (ids.size() >= limit) break;
+        ids.push_back(e.pageId);
+    }
+    return ids;
+}
+
+size_t PageCache::size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+void PageCache::insertLocked(uint32_t pageId, const void *page) {
+    auto it = m_index.find(pageId);
+    if (it != m_index.end()) {
+        std::memcpy(it->second->data.data(), page, m_pageSize);
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return;
+    }
+    if (m_lru.size() >= m_capacity) {
+        // evict least recently used, reusing its buffer
+        auto victim = std::prev(m_lru.end());
+        m_index.erase(victim->pageId);
+        victim->pageId = pageId;
+        std::memcpy(victim->data.data(), page, m_pageSize);
+        m_lru.splice(m_lru.begin(), m_lru, victim);
+        m_index[pageId] = m_lru.begin();
+        return;
+    }
+    m_lru.push_front(Entry{pageId, std::vector<uint8_t>(
+        static_cast<const uint8_t *>(page),
+        static_cast<const uint8_t *>(page) + m_pageSize)});
+    m_index[pageId] = m_lru.begin();
+}
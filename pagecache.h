@@ -0,0 +1,67 @@
+// In-memory LRU cache of fixed-size pages used by the B+ tree.
+// The cache is write-through: every page written to disk is also stored here,
+// so cached pages are never dirty and can be dropped at any time.
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class PageCache {
+public:
+    PageCache(size_t capacityPages, size_t pageSize);
+
+    // disable copy
+    PageCache(const PageCache &) = delete;
+    PageCache &operator=(const PageCache &) = delete;
+
+    // Copies the cached page into out and marks it most recently used.
+    // Returns false on a miss.
+    bool get(uint32_t pageId, void *out);
+
+    // Inserts or replaces a page (foreground reads and writes).
+    void put(uint32_t pageId, const void *page);
+
+    // Inserts a page read in the background, unless the page is already
+    // cached or was put() by the foreground since beginTracking().
+    // Background data may be older than such a put, so it must not win.
+    bool putIfUntouched(uint32_t pageId, const void *page);
+
+    void beginTracking();
+    void endTracking();
+    // True if the page was put() since beginTracking().
+    bool touched(uint32_t pageId) const;
+
+    void erase(uint32_t pageId);
+    void clear();
+
+    // Cached page ids, most recently used first.
+    std::vector<uint32_t> hotPages(size_t limit) const;
+
+    size_t capacity() const { return m_capacity; }
+    size_t size() const;
+
+private:
+    struct Entry {
+        uint32_t pageId;
+        std::vector<uint8_t> data;
+    };
+
+    void insertLocked(uint32_t pageId, const void *page);
+
+    size_t m_capacity;
+    size_t m_pageSize;
+    mutable std::mutex m_mutex;
+    std::list<Entry> m_lru; // front = most recently used
+    std::unordered_map<uint32_t, std::list<Entry>::iterator> m_index;
+    bool m_tracking;
+    std::unordered_set<uint32_t> m_touched;
+};
+
+#endif // PAGECACHE_H
@@ -0,0 +1,326 @@
+// Secondary index B+ tree implementation
+
+#include "secindex.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+constexpr uint32_t INDEX_MAGIC = 0x42505349u; // "BPSI"
+
+} // namespace
+
+SecondaryIndex::SecondaryIndex(const std::string &filename, size_t cachePages)
+    : m_fd(-1), m_ok(false), m_pageCount(0), m_header{}, m_cache(cachePages, PAGE_SIZE) {
+    m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0 && (errno == EACCES || errno == EROFS)) {
+        m_fd = ::open(filename.c_str(), O_RDONLY);
+    }
+    if (m_fd < 0) {
+        perror("open");
+        return;
+    }
+    off_t end = lseek(m_fd, 0, SEEK_END);
+    if (end < 0) return;
+    m_pageCount = static_cast<uint32_t>(end / PAGE_SIZE);
+    if (m_pageCount == 0) {
+        m_ok = initEmpty();
+        return;
+    }
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(0, buf.data())) return;
+    std::memcpy(&m_header, buf.data(), sizeof(m_header));
+    if (m_header.magic != INDEX_MAGIC || m_header.pageSize != PAGE_SIZE) {
+        std::cerr << "Invalid secondary index file header\n";
+        return;
+    }
+    m_ok = true;
+}
+
+SecondaryIndex::~SecondaryIndex() {
+    if (m_fd >= 0) ::close(m_fd);
+}
+
+bool SecondaryIndex::readPage(uint32_t pageId, void *page) {
+    if (m_cache.get(pageId, page)) return true;
+    ssize_t n = ::pread(m_fd, page, PAGE_SIZE, static_cast<off_t>(pageOffset(pageId)));
+    if (n != static_cast<ssize_t>(PAGE_SIZE)) return false;
+    m_cache.put(pageId, page);
+    return true;
+}
+
+bool SecondaryIndex::writePage(uint32_t pageId, const void *page) {
+    ssize_t n = ::pwrite(m_fd, page, PAGE_SIZE, static_cast<off_t>(pageOffset(pageId)));
+    if (n != static_cast<ssize_t>(PAGE_SIZE)) {
+        m_cache.erase(pageId);
+        return false;
+    }
+    m_cache.put(pageId, page);
+    if (pageId >= m_pageCount) m_pageCount = pageId + 1;
+    return true;
+}
+
+uint32_t SecondaryIndex::allocatePage() {
+    return m_pageCount++;
+}
+
+bool SecondaryIndex::initEmpty() {
+    m_header.magic = INDEX_MAGIC;
+    m_header.pageSize = PAGE_SIZE;
+    m_header.rootPage = 1;
+    m_pageCount = 2;
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    LeafNode leaf{};
+    leaf.hdr.type = static_cast<uint8_t>(NodeType::LEAF);
+    leaf.hdr.nextLeaf = INVALID_PAGE;
+    std::memcpy(buf.data(), &leaf, sizeof(leaf));
+    return writePage(1, buf.data()) && flushHeader();
+}
+
+bool SecondaryIndex::flushHeader() {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    std::memcpy(buf.data(), &m_header, sizeof(m_header));
+    return writePage(0, buf.data());
+}
+
+uint32_t SecondaryIndex::findLeafPage(uint64_t key) {
+    uint32_t page = m_header.rootPage;
+    while (true) {
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        if (!readPage(page, buf.data())) return INVALID_PAGE;
+        NodeHeader nh{};
+        std::memcpy(&nh, buf.data(), sizeof(nh));
+        if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) return page;
+        InternalNode node{};
+        std::memcpy(&node, buf.data(), sizeof(node));
+        uint32_t i = static_cast<uint32_t>(
+            std::upper_bound(node.keys, node.keys + node.hdr.numKeys, key) - node.keys);
+        page = node.children[i];
+    }
+}
+
+bool SecondaryIndex::insert(uint64_t key) {
+    if (!m_ok) return false;
+    uint64_t splitKey = 0;
+    uint32_t splitPage = INVALID_PAGE;
+    if (!insertInto(m_header.rootPage, key, splitKey, splitPage)) return false;
+    if (splitPage == INVALID_PAGE) return true;
+
+    // root split: grow a level
+    InternalNode root{};
+    root.hdr.type = static_cast<uint8_t>(NodeType::INTERNAL);
+    root.hdr.numKeys = 1;
+    root.keys[0] = splitKey;
+    root.children[0] = m_header.rootPage;
+    root.children[1] = splitPage;
+    uint32_t rootPage = allocatePage();
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    std::memcpy(buf.data(), &root, sizeof(root));
+    if (!writePage(rootPage, buf.data())) return false;
+    m_header.rootPage = rootPage;
+    return flushHeader();
+}
+
+bool SecondaryIndex::insertInto(uint32_t pageId, uint64_t key, uint64_t &splitKey,
+                                uint32_t &splitPage) {
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(pageId, buf.data())) return false;
+    NodeHeader nh{};
+    std::memcpy(&nh, buf.data(), sizeof(nh));
+
+    if (nh.type == static_cast<uint8_t>(NodeType::LEAF)) {
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        uint64_t *end = leaf.keys + leaf.hdr.numKeys;
+        uint64_t *pos = std::lower_bound(leaf.keys, end, key);
+        if (pos != end && *pos == key) return true;
+        uint32_t idx = static_cast<uint32_t>(pos - leaf.keys);
+
+        if (leaf.hdr.numKeys < LEAF_MAX_KEYS) {
+            std::memmove(pos + 1, pos, sizeof(uint64_t) * (leaf.hdr.numKeys - idx));
+            *pos = key;
+            ++leaf.hdr.numKeys;
+            std::memcpy(buf.data(), &leaf, sizeof(leaf));
+            return writePage(pageId, buf.data());
+        }
+
+        // split: the lower half stays, the upper half moves to a new right leaf
+        uint64_t tmp[LEAF_MAX_KEYS + 1];
+        std::memcpy(tmp, leaf.keys, sizeof(uint64_t) * idx);
+        tmp[idx] = key;
+        std::memcpy(tmp + idx + 1, leaf.keys + idx, sizeof(uint64_t) * (LEAF_MAX_KEYS - idx));
+        uint32_t total = LEAF_MAX_KEYS + 1;
+        uint32_t split = total / 2;
+
+        LeafNode right{};
+        right.hdr.type = static_cast<uint8_t>(NodeType::LEAF);
+        right.hdr.numKeys = total - split;
+        right.hdr.nextLeaf = leaf.hdr.nextLeaf;
+        std::memcpy(right.keys, tmp + split, sizeof(uint64_t) * right.hdr.numKeys);
+        splitPage = allocatePage();
+        splitKey = right.keys[0];
+
+        leaf.hdr.numKeys = split;
+        leaf.hdr.nextLeaf = splitPage;
+        std::memcpy(leaf.keys, tmp, sizeof(uint64_t) * split);
+
+        std::array<uint8_t, PAGE_SIZE> rbuf{};
+        std::memcpy(rbuf.data(), &right, sizeof(right));
+        if (!writePage(splitPage, rbuf.data())) return false;
+        std::memcpy(buf.data(), &leaf, sizeof(leaf));
+        return writePage(pageId, buf.data());
+    }
+
+    InternalNode node{};
+    std::memcpy(&node, buf.data(), sizeof(node));
+    uint32_t idx = static_cast<uint32_t>(
+        std::upper_bound(node.keys, node.keys + node.hdr.numKeys, key) - node.keys);
+    uint64_t childKey = 0;
+    uint32_t childPage = INVALID_PAGE;
+    if (!insertInto(node.children[idx], key, childKey, childPage)) return false;
+    if (childPage == INVALID_PAGE) return true;
+
+    uint32_t n = node.hdr.numKeys;
+    if (n < INTERNAL_MAX_KEYS) {
+        std::memmove(node.keys + idx + 1, node.keys + idx, sizeof(uint64_t) * (n - idx));
+        std::memmove(node.children + idx + 2, node.children + idx + 1,
+                     sizeof(uint32_t) * (n - idx));
+        node.keys[idx] = childKey;
+        node.children[idx + 1] = childPage;
+        ++node.hdr.numKeys;
+        std::memcpy(buf.data(), &node, sizeof(node));
+        return writePage(pageId, buf.data());
+    }
+
+    // split: the middle key moves up, keys after it go to the new right node
+    uint64_t tmpKeys[INTERNAL_MAX_KEYS + 1];
+    uint32_t tmpChildren[INTERNAL_MAX_KEYS + 2];
+    std::memcpy(tmpKeys, node.keys, sizeof(uint64_t) * idx);
+    tmpKeys[idx] = childKey;
+    std::memcpy(tmpKeys + idx + 1, node.keys + idx, sizeof(uint64_t) * (n - idx));
+    std::memcpy(tmpChildren, node.children, sizeof(uint32_t) * (idx + 1));
+    tmpChildren[idx + 1] = childPage;
+    std::memcpy(tmpChildren + idx + 2, node.children + idx + 1, sizeof(uint32_t) * (n - idx));
+    uint32_t total = n + 1;
+    uint32_t mid = total / 2;
+
+    InternalNode right{};
+    right.hdr.type = static_cast<uint8_t>(NodeType::INTERNAL);
+    right.hdr.numKeys = total - mid - 1;
+    std::memcpy(right.keys, tmpKeys + mid + 1, sizeof(uint64_t) * right.hdr.numKeys);
+    std::memcpy(right.children, tmpChildren + mid + 1, sizeof(uint32_t) * (right.hdr.numKeys + 1));
+    node.hdr.numKeys = mid;
+    std::memcpy(node.keys, tmpKeys, sizeof(uint64_t) * mid);
+    std::memcpy(node.children, tmpChildren, sizeof(uint32_t) * (mid + 1));
+    splitKey = tmpKeys[mid];
+    splitPage = allocatePage();
+
+    std::array<uint8_t, PAGE_SIZE> rbuf{};
+    std::memcpy(rbuf.data(), &right, sizeof(right));
+    if (!writePage(splitPage, rbuf.data())) return false;
+    std::memcpy(buf.data(), &node, sizeof(node));
+    return writePage(pageId, buf.data());
+}
+
+bool SecondaryIndex::erase(uint64_t key) {
+    if (!m_ok) return false;
+    uint32_t page = findLeafPage(key);
+    if (page == INVALID_PAGE) return false;
+    std::array<uint8_t, PAGE_SIZE> buf{};
+    if (!readPage(page, buf.data())) return false;
+    LeafNode leaf{};
+    std::memcpy(&leaf, buf.data(), sizeof(leaf));
+    uint64_t *end = leaf.keys + leaf.hdr.numKeys;
+    uint64_t *pos = std::lower_bound(leaf.keys, end, key);
+    if (pos == end || *pos != key) return false;
+    // Simplified like the primary tree: no rebalancing
+    std::memmove(pos, pos + 1, sizeof(uint64_t) * static_cast<size_t>(end - pos - 1));
+    --leaf.hdr.numKeys;
+    std::memcpy(buf.data(), &leaf, sizeof(leaf));
+    return writePage(page, buf.data());
+}
+
+bool SecondaryIndex::bulkLoad(const std::vector<uint64_t> &keys) {
+    if (m_fd < 0) return false;
+    m_ok = false;
+    m_cache.clear();
+    if (::ftruncate(m_fd, 0) != 0) return false;
+    m_pageCount = 1; // page 0 is the header
+
+    // Leaves, packed full and linked in page order
+    std::vector<std::pair<uint64_t, uint32_t>> level; // (first key, page)
+    size_t pos = 0;
+    do {
+        LeafNode leaf{};
+        leaf.hdr.type = static_cast<uint8_t>(NodeType::LEAF);
+        leaf.hdr.numKeys = static_cast<uint32_t>(std::min<size_t>(LEAF_MAX_KEYS, keys.size() - pos));
+        std::copy(keys.begin() + pos, keys.begin() + pos + leaf.hdr.numKeys, leaf.keys);
+        pos += leaf.hdr.numKeys;
+        uint32_t page = allocatePage();
+        leaf.hdr.nextLeaf = pos < keys.size() ? page + 1 : INVALID_PAGE;
+        level.emplace_back(leaf.hdr.numKeys ? leaf.keys[0] : 0, page);
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        std::memcpy(buf.data(), &leaf, sizeof(leaf));
+        if (!writePage(page, buf.data())) return false;
+    } while (pos < keys.size());
+
+    // Internal levels bottom-up, children spread evenly over the fewest nodes
+    while (level.size() > 1) {
+        const size_t fanout = INTERNAL_MAX_KEYS + 1;
+        size_t nodes = (level.size() + fanout - 1) / fanout;
+        std::vector<std::pair<uint64_t, uint32_t>> parents;
+        size_t first = 0;
+        for (size_t n = 0; n < nodes; ++n) {
+            size_t count = level.size() / nodes + (n < level.size() % nodes ? 1 : 0);
+            InternalNode node{};
+            node.hdr.type = static_cast<uint8_t>(NodeType::INTERNAL);
+            node.hdr.numKeys = static_cast<uint32_t>(count - 1);
+            for (size_t c = 0; c < count; ++c) {
+                node.children[c] = level[first + c].second;
+                if (c > 0) node.keys[c - 1] = level[first + c].first;
+            }
+            uint32_t page = allocatePage();
+            parents.emplace_back(level[first].first, page);
+            std::array<uint8_t, PAGE_SIZE> buf{};
+            std::memcpy(buf.data(), &node, sizeof(node));
+            if (!writePage(page, buf.data())) return false;
+            first += count;
+        }
+        level.swap(parents);
+    }
+
+    m_header.magic = INDEX_MAGIC;
+    m_header.pageSize = PAGE_SIZE;
+    m_header.rootPage = level[0].second;
+    m_ok = flushHeader();
+    return m_ok;
+}
+
+bool SecondaryIndex::scan(uint64_t lower, uint64_t upper,
+                          const std::function<bool(uint64_t key)> &fn) {
+    if (!m_ok) return false;
+    uint32_t page = findLeafPage(lower);
+    while (page != INVALID_PAGE) {
+        std::array<uint8_t, PAGE_SIZE> buf{};
+        if (!readPage(page, buf.data())) return false;
+        LeafNode leaf{};
+        std::memcpy(&leaf, buf.data(), sizeof(leaf));
+        uint64_t *end = leaf.keys + leaf.hdr.numKeys;
+        for (uint64_t *k = std::lower_bound(leaf.keys, end, lower); k != end; ++k) {
+            if (*k > upper) return true;
+            if (!fn(*k)) return true;
+        }
+        page = leaf.hdr.nextLeaf;
+    }
+    return true;
+}
@@ -0,0 +1,105 @@
+// Disk-backed B+ tree over unsigned 64-bit keys with no payload.
+// BPlusTree keeps one per secondary index, keyed by (field value, primary
+// key) packed into the high and low 32 bits: equal field values stay
+// distinct, and all entries for a range of field values form one
+// contiguous key range. Same page layout rules as the primary tree
+// (page 0 is the header, linked leaves, no rebalancing on erase).
+
+#ifndef SECINDEX_H
+#define SECINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "pagecache.h"
+
+// Default page cache size of a secondary index: 256 pages = 1 MiB
+static constexpr size_t DEFAULT_INDEX_CACHE_PAGES = 256;
+
+class SecondaryIndex {
+public:
+    explicit SecondaryIndex(const std::string &filename,
+                            size_t cachePages = DEFAULT_INDEX_CACHE_PAGES);
+    ~SecondaryIndex();
+
+    // disable copy
+    SecondaryIndex(const SecondaryIndex &) = delete;
+    SecondaryIndex &operator=(const SecondaryIndex &) = delete;
+
+    bool isOk() const { return m_ok; }
+
+    // Adds key (a no-op if it is already present).
+    bool insert(uint64_t key);
+    // Removes key. Returns false if it was not present.
+    bool erase(uint64_t key);
+    // Replaces the whole contents with 'keys' (sorted, no duplicates),
+    // written bottom-up with every node full.
+    bool bulkLoad(const std::vector<uint64_t> &keys);
+    // Calls fn(key) for every key in [lower, upper] in ascending order;
+    // fn returns false to stop. Returns false on I/O error.
+    bool scan(uint64_t lower, uint64_t upper, const std::function<bool(uint64_t key)> &fn);
+
+private:
+    static constexpr uint32_t PAGE_SIZE = 4096;
+    static constexpr uint32_t INVALID_PAGE = 0xFFFFFFFFu;
+    // 16-byte header + 8-byte keys (+ 4-byte children) per page
+    static constexpr uint32_t INTERNAL_MAX_KEYS = 339;
+    static constexpr uint32_t LEAF_MAX_KEYS = 510;
+
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t pageSize;
+        uint32_t rootPage;
+    };
+
+    enum class NodeType : uint8_t {
+        INTERNAL = 0,
+        LEAF = 1
+    };
+
+    struct NodeHeader {
+        uint8_t type;     // NodeType
+        uint32_t numKeys;
+        uint32_t nextLeaf; // leaves only: page id of next leaf or INVALID_PAGE
+    };
+
+    struct InternalNode {
+        NodeHeader hdr;
+        uint64_t keys[INTERNAL_MAX_KEYS];
+        uint32_t children[INTERNAL_MAX_KEYS + 1];
+    };
+
+    struct LeafNode {
+        NodeHeader hdr;
+        uint64_t keys[LEAF_MAX_KEYS];
+    };
+
+    static_assert(sizeof(InternalNode) <= PAGE_SIZE, "internal node must fit in a page");
+    static_assert(sizeof(LeafNode) <= PAGE_SIZE, "leaf node must fit in a page");
+
+    bool readPage(uint32_t pageId, void *page);
+    bool writePage(uint32_t pageId, const void *page);
+    uint32_t allocatePage();
+    bool initEmpty();
+    bool flushHeader();
+
+    // Inserts into the subtree at pageId. If the node splits, splitKey is
+    // the first key of the new right sibling splitPage.
+    bool insertInto(uint32_t pageId, uint64_t key, uint64_t &splitKey, uint32_t &splitPage);
+    uint32_t findLeafPage(uint64_t key);
+
+    static uint64_t pageOffset(uint32_t pageId) {
+        return static_cast<uint64_t>(pageId) * PAGE_SIZE;
+    }
+
+    int m_fd;
+    bool m_ok;
+    uint32_t m_pageCount;
+    FileHeader m_header;
+    PageCache m_cache;
+};
+
+#endif // SECINDEX_H
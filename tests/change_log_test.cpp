@@ -0,0 +1,159 @@
+// The change log survives a reopen of the leader, and a failed append
+// refuses further writes, also after a reopen, until the log is reset.
+
+#include "../bplustree.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n";    \
+            ++failures;                                                     \
+        }                                                                   \
+    } while (0)
+
+void removeFiles(const std::string &name) {
+    for (const char *suffix : {"", ".wal", ".warm"}) ::unlink((name + suffix).c_str());
+}
+
+void valueFor(int32_t key, uint8_t data[VALUE_SIZE]) {
+    std::memset(data, 0, VALUE_SIZE);
+    std::snprintf(reinterpret_cast<char *>(data), VALUE_SIZE, "value %d", key);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const std::string dir = argc > 1 ? argv[1] : "/tmp";
+    const std::string leader = dir + "/bpt_test_leader.dat";
+    const std::string replica = dir + "/bpt_test_replica.dat";
+    const std::string log = dir + "/bpt_test_changes.log";
+    removeFiles(leader);
+    removeFiles(replica);
+    ::unlink(log.c_str());
+    uint8_t data[VALUE_SIZE];
+    uint8_t got[VALUE_SIZE];
+
+    {
+        BPlusTree tree(leader);
+        CHECK(tree.enableChangeLog(log));
+        int fd = ::open(replica.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0);
+        CHECK(tree.startBackup(fd));
+        CHECK(tree.finishBackup());
+        ::close(fd);
+        for (int32_t k = 0; k < 5; ++k) {
+            valueFor(k, data);
+            CHECK(tree.writeData(k, data));
+        }
+    }
+    {
+        // the log is reopened with the file
+        BPlusTree tree(leader);
+        for (int32_t k = 5; k < 10; ++k) {
+            valueFor(k, data);
+            CHECK(tree.writeData(k, data));
+        }
+    }
+    {
+        BPlusTree copy(replica);
+        CHECK(!copy.changeLogBroken());
+        CHECK(copy.applyChangeLog(log));
+        for (int32_t k = 0; k < 10; ++k) {
+            valueFor(k, data);
+            CHECK(copy.readData(k, got) && std::memcmp(got, data, VALUE_SIZE) == 0);
+        }
+    }
+
+    // Cap file sizes so the growing log fails while the small index does not
+    std::signal(SIGXFSZ, SIG_IGN);
+    struct rlimit saved{};
+    CHECK(::getrlimit(RLIMIT_FSIZE, &saved) == 0);
+    {
+        BPlusTree tree(leader);
+        struct rlimit capped = saved;
+        capped.rlim_cur = 256 * 1024;
+        CHECK(::setrlimit(RLIMIT_FSIZE, &capped) == 0);
+        valueFor(1, data);
+        int writes = 0;
+        while (writes < 100000 && tree.writeData(1, data)) ++writes;
+        CHECK(writes < 100000);
+        CHECK(tree.changeLogBroken());
+        CHECK(!tree.writeData(2, data));
+        CHECK(::setrlimit(RLIMIT_FSIZE, &saved) == 0);
+    }
+    {
+        BPlusTree tree(leader);
+        CHECK(tree.changeLogBroken());
+        CHECK(!tree.deleteData(1));
+        CHECK(tree.resetChangeLog());
+        CHECK(!tree.changeLogBroken());
+        CHECK(tree.deleteData(1));
+    }
+
+    // A damaged record in the middle of a long log stops the replica there
+    removeFiles(leader);
+    removeFiles(replica);
+    ::unlink(log.c_str());
+    const int32_t changes = 20000;
+    const int32_t damaged = 12345;
+    {
+        BPlusTree tree(leader);
+        CHECK(tree.enableChangeLog(log));
+        int fd = ::open(replica.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0);
+        CHECK(tree.startBackup(fd));
+        CHECK(tree.finishBackup());
+        ::close(fd);
+        for (int32_t k = 0; k < changes; ++k) {
+            valueFor(k, data);
+            CHECK(tree.writeData(k, data));
+        }
+    }
+    struct stat st{};
+    CHECK(::stat(log.c_str(), &st) == 0);
+    // the log is a header followed by equal-sized records
+    const off_t recordSize = st.st_size / changes;
+    const off_t headerSize = st.st_size - changes * recordSize;
+    int fd = ::open(log.c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    uint8_t byte = 0;
+    const off_t at = headerSize + damaged * recordSize + recordSize / 2;
+    CHECK(::pread(fd, &byte, 1, at) == 1);
+    byte ^= 0xff;
+    CHECK(::pwrite(fd, &byte, 1, at) == 1);
+    ::close(fd);
+    {
+        BPlusTree copy(replica);
+        CHECK(!copy.applyChangeLog(log));
+        valueFor(damaged - 1, data);
+        CHECK(copy.readData(damaged - 1, got) && std::memcmp(got, data, VALUE_SIZE) == 0);
+        CHECK(!copy.readData(damaged, got));
+        CHECK(!copy.readData(changes - 1, got));
+    }
+
+    removeFiles(leader);
+    removeFiles(replica);
+    ::unlink(log.c_str());
+    if (failures != 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "change_log_test: ok\n";
+    return 0;
+}
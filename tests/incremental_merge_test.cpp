@@ -0,0 +1,122 @@
+// An incremental backup taken across a merge that rebuilt (and shrank) the
+// source must restore to a file that passes the integrity check.
+
+#include "../bplustree.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n";    \
+            ++failures;                                                     \
+        }                                                                   \
+    } while (0)
+
+void removeFiles(const std::string &name) {
+    for (const char *suffix : {"", ".wal", ".wal.tmp", ".warm"}) {
+        ::unlink((name + suffix).c_str());
+    }
+}
+
+off_t fileSize(const std::string &name) {
+    struct stat st{};
+    return ::stat(name.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+void valueFor(int32_t key, uint8_t data[VALUE_SIZE]) {
+    std::memset(data, 0, VALUE_SIZE);
+    std::snprintf(reinterpret_cast<char *>(data), VALUE_SIZE, "value %d", key);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const std::string dir = argc > 1 ? argv[1] : "/tmp";
+    const std::string source = dir + "/bpt_test_source.dat";
+    const std::string delta = dir + "/bpt_test_delta.dat";
+    const std::string base = dir + "/bpt_test_base.dat";
+    const std::string incr = dir + "/bpt_test_incr.bin";
+    for (const std::string &f : {source, delta, base}) removeFiles(f);
+    ::unlink(incr.c_str());
+
+    const int32_t keys = 60000;
+    uint8_t data[VALUE_SIZE];
+    uint8_t got[VALUE_SIZE];
+    {
+        BPlusTree tree(source);
+        // every 7th key is left for the delta, so the merge spreads across the tree
+        for (int32_t k = 0; k < keys; ++k) {
+            valueFor(k, data);
+            CHECK(tree.writeData(k * 7 + 1, data));
+        }
+
+        // full backup: the base the incremental is applied to
+        uint64_t sinceLsn = tree.lastLsn();
+        int fd = ::open(base.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0);
+        CHECK(tree.startBackup(fd));
+        CHECK(tree.finishBackup());
+        ::close(fd);
+
+        {
+            BPlusTree d(delta);
+            for (int32_t k = 0; k < 10; ++k) {
+                valueFor(k * 7000, data);
+                CHECK(d.writeData(k * 7000, data));
+            }
+            CHECK(tree.merge(d, MergeStrategy::REBUILD));
+        }
+        CHECK(tree.checkIntegrity());
+
+        fd = ::open(incr.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        CHECK(fd >= 0);
+        CHECK(tree.startIncrementalBackup(fd, sinceLsn));
+        CHECK(tree.finishBackup());
+        ::close(fd);
+    }
+    // the packed rebuild is smaller than the tree it replaced
+    CHECK(fileSize(source) < fileSize(base));
+
+    int fd = ::open(incr.c_str(), O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(BPlusTree::restoreIncremental(base, fd));
+    ::close(fd);
+    CHECK(fileSize(base) == fileSize(source));
+    {
+        BPlusTree restored(base);
+        std::vector<std::string> errors;
+        CHECK(restored.checkIntegrity(0, &errors));
+        for (const std::string &e : errors) std::cerr << e << "\n";
+        for (int32_t k = 0; k < keys; ++k) {
+            valueFor(k, data);
+            CHECK(restored.readData(k * 7 + 1, got) && std::memcmp(got, data, VALUE_SIZE) == 0);
+        }
+        for (int32_t k = 0; k < 10; ++k) {
+            valueFor(k * 7000, data);
+            CHECK(restored.readData(k * 7000, got) && std::memcmp(got, data, VALUE_SIZE) == 0);
+        }
+    }
+
+    for (const std::string &f : {source, delta, base}) removeFiles(f);
+    ::unlink(incr.c_str());
+    if (failures != 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "incremental_merge_test: ok\n";
+    return 0;
+}
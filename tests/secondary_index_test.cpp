@@ -0,0 +1,132 @@
+// Secondary indexes are rebuilt after an unclean shutdown or when their
+// file is damaged, and lookups never return a record whose field no
+// longer matches.
+
+#include "../bplustree.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond "\n";    \
+            ++failures;                                                     \
+        }                                                                   \
+    } while (0)
+
+const FieldDesc FIELD{0, FieldType::INT32};
+
+void valueFor(int32_t field, uint8_t data[VALUE_SIZE]) {
+    std::memset(data, 0, VALUE_SIZE);
+    std::memcpy(data, &field, sizeof(field));
+}
+
+bool copyFile(const std::string &from, const std::string &to) {
+    FILE *in = std::fopen(from.c_str(), "rb");
+    FILE *out = std::fopen(to.c_str(), "wb");
+    bool ok = in && out;
+    char buf[4096];
+    size_t n = 0;
+    while (ok && (n = std::fread(buf, 1, sizeof(buf), in)) > 0) {
+        ok = std::fwrite(buf, 1, n, out) == n;
+    }
+    if (in) std::fclose(in);
+    if (out) std::fclose(out);
+    return ok;
+}
+
+// marks the file as not closed cleanly, as a crash would leave it
+bool setOpenFlag(const std::string &name) {
+    int fd = ::open(name.c_str(), O_RDWR);
+    uint32_t flags = 0;
+    const off_t at = 4 * sizeof(uint32_t); // magic, pageSize, rootPage, freeListHead
+    bool ok = fd >= 0 && ::pread(fd, &flags, sizeof(flags), at) == sizeof(flags);
+    flags |= 4u; // FILE_FLAG_OPEN
+    ok = ok && ::pwrite(fd, &flags, sizeof(flags), at) == sizeof(flags);
+    if (fd >= 0) ::close(fd);
+    return ok;
+}
+
+std::vector<int32_t> lookup(BPlusTree &tree, int32_t value) {
+    std::vector<Record> records;
+    std::vector<int32_t> keys;
+    CHECK(tree.lookupByField(FIELD, value, value, records));
+    for (const Record &r : records) keys.push_back(r.key);
+    return keys;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    const std::string dir = argc > 1 ? argv[1] : "/tmp";
+    const std::string file = dir + "/bpt_test_secindex.dat";
+    const std::string index = file + ".idx-0-" + std::to_string(static_cast<unsigned>(FIELD.type));
+    const std::string saved = index + ".saved";
+    for (const std::string &f : {file, file + ".wal", file + ".warm", index, saved}) {
+        ::unlink(f.c_str());
+    }
+    uint8_t data[VALUE_SIZE];
+
+    {
+        BPlusTree tree(file);
+        for (int32_t k = 0; k < 1000; ++k) {
+            valueFor(k % 10, data);
+            CHECK(tree.writeData(k, data));
+        }
+        CHECK(tree.createIndex(FIELD));
+    }
+    // Key 5 moves from value 5 to 99, but its index update is lost
+    CHECK(copyFile(index, saved));
+    {
+        BPlusTree tree(file);
+        valueFor(99, data);
+        CHECK(tree.writeData(5, data));
+    }
+    CHECK(copyFile(saved, index));
+    {
+        // clean shutdown: the stale entry is filtered out
+        BPlusTree tree(file);
+        std::vector<int32_t> keys = lookup(tree, 5);
+        CHECK(keys.size() == 99 && keys[0] == 15);
+    }
+    CHECK(copyFile(saved, index));
+    CHECK(setOpenFlag(file));
+    {
+        // unclean shutdown: the index is rebuilt and finds the record
+        BPlusTree tree(file);
+        CHECK(lookup(tree, 99) == std::vector<int32_t>{5});
+        CHECK(lookup(tree, 5).size() == 99);
+    }
+
+    // An index file torn while it was being built does not stop the open
+    CHECK(::truncate(index.c_str(), 0) == 0);
+    CHECK(::truncate(index.c_str(), 4096) == 0);
+    {
+        BPlusTree tree(file);
+        CHECK(tree.isReadOnly() == false);
+        CHECK(lookup(tree, 99) == std::vector<int32_t>{5});
+        CHECK(lookup(tree, 7).size() == 100);
+    }
+
+    for (const std::string &f : {file, file + ".wal", file + ".warm", index, saved}) {
+        ::unlink(f.c_str());
+    }
+    if (failures != 0) {
+        std::cerr << failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << "secondary_index_test: ok\n";
+    return 0;
+}